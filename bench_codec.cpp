@@ -0,0 +1,303 @@
+#include <cstring>
+#include <iostream>
+#include <string>
+
+#include "bswap.hpp"
+#include "message.hpp"
+#include "ring.hpp"
+#include "tetris.hpp"
+
+// frame codec microbenchmark: nanoseconds per message to encode a frame, and
+// to parse and dispatch it off a ring, for each payload size and both header
+// formats. each is timed three ways where it applies: the hand-written
+// switch the schema replaced (baseline), the schema's dispatch on
+// header.type, which the send queues use, and encode<T> for a caller that
+// knows the type. usage: bench_codec [messages per run]
+
+static volatile std::size_t sink;
+
+// the codec as it was before the schema: one function pair per layout and
+// a switch per direction. input has since grown a seq and _ping/_pong a
+// sync payload; they are written the same way
+
+namespace baseline {
+
+namespace field {
+  constexpr uint16_t size = message::field::size;
+
+  static inline int _cell_index(int u, int v)
+  {
+    return (v * tetris::columns + u);
+  }
+
+  static void decode(const std::uint8_t * buf, tetris::field& field)
+  {
+    for (int u = 0; u < tetris::columns; u++) {
+      for (int v = 0; v < tetris::rows; v++) {
+        const int bi = _cell_index(u, v);
+        field[u][v].color = static_cast<tetris::tet>(buf[bi]);
+      }
+    }
+  }
+
+  static void encode(const tetris::field& field, std::uint8_t * buf)
+  {
+    for (int u = 0; u < tetris::columns; u++) {
+      for (int v = 0; v < tetris::rows; v++) {
+        const int bi = _cell_index(u, v);
+        buf[bi] = static_cast<uint8_t>(field[u][v].color);
+      }
+    }
+  }
+}
+
+namespace piece {
+  constexpr uint16_t size = message::piece::size;
+
+  static void decode(const std::uint8_t * buf, tetris::piece& piece)
+  {
+    piece.tet = static_cast<tetris::tet>(buf[0]);
+    piece.facing = static_cast<tetris::dir>(buf[1]);
+    piece.pos.u = ((std::int8_t*)buf)[2];
+    piece.pos.v = ((std::int8_t*)buf)[3];
+    piece.drop_row = ((std::int8_t*)buf)[4];
+  }
+
+  static void encode(const tetris::piece& piece, std::uint8_t * buf)
+  {
+    buf[0] = static_cast<uint8_t>(piece.tet);
+    buf[1] = static_cast<uint8_t>(piece.facing);
+    ((std::int8_t*)buf)[2] = piece.pos.u;
+    ((std::int8_t*)buf)[3] = piece.pos.v;
+    ((std::int8_t*)buf)[4] = piece.drop_row;
+  }
+}
+
+namespace attack {
+  constexpr uint16_t size = message::attack::size;
+
+  static void decode(const std::uint8_t * buf, tetris::attack_t& attack)
+  {
+    attack.rows = buf[0];
+    attack.column = buf[1];
+  }
+
+  static void encode(const tetris::attack_t& attack, std::uint8_t * buf)
+  {
+    buf[0] = attack.rows;
+    buf[1] = attack.column;
+  }
+}
+
+namespace input {
+  constexpr uint16_t size = message::input::size;
+
+  static void decode(const std::uint8_t * buf, message::input_t& input)
+  {
+    input.event = static_cast<tetris::event>(buf[0]);
+    input.time = bswap::ntoh(*((uint32_t *)(buf + 1)));
+    input.seq = bswap::ntoh(*((uint32_t *)(buf + 5)));
+  }
+
+  static void encode(const message::input_t& input, std::uint8_t * buf)
+  {
+    buf[0] = static_cast<uint8_t>(input.event);
+    *((uint32_t *)(buf + 1)) = bswap::hton(input.time);
+    *((uint32_t *)(buf + 5)) = bswap::hton(input.seq);
+  }
+}
+
+namespace sync {
+  constexpr uint16_t size = message::sync::size;
+
+  static void decode(const std::uint8_t * buf, message::sync_t& sync)
+  {
+    sync.origin = bswap::ntoh(*((uint64_t *)(buf + 0)));
+    sync.receive = bswap::ntoh(*((uint64_t *)(buf + 8)));
+    sync.transmit = bswap::ntoh(*((uint64_t *)(buf + 16)));
+  }
+
+  static void encode(const message::sync_t& sync, std::uint8_t * buf)
+  {
+    *((uint64_t *)(buf + 0)) = bswap::hton(sync.origin);
+    *((uint64_t *)(buf + 8)) = bswap::hton(sync.receive);
+    *((uint64_t *)(buf + 16)) = bswap::hton(sync.transmit);
+  }
+}
+
+static size_t encode(const message::frame_header_t& header, const message::next_t& next, std::uint8_t * buf)
+{
+  const size_t header_size = message::frame_header::size_of(header);
+  message::frame_header::encode(header, buf);
+  buf += header_size;
+  switch (header.type) {
+  case message::type_t::_field:
+    field::encode(std::get<tetris::field>(next), buf);
+    return header_size + field::size;
+  case message::type_t::_next_piece:
+  case message::type_t::_move:
+  case message::type_t::_drop:
+    piece::encode(std::get<tetris::piece>(next), buf);
+    return header_size + piece::size;
+  case message::type_t::_attack:
+    attack::encode(std::get<tetris::attack_t>(next), buf);
+    return header_size + attack::size;
+  case message::type_t::_input:
+    input::encode(std::get<message::input_t>(next), buf);
+    return header_size + input::size;
+  case message::type_t::_ping:
+  case message::type_t::_pong:
+    sync::encode(std::get<message::sync_t>(next), buf);
+    return header_size + sync::size;
+  default:
+    throw "baseline encode";
+  }
+}
+
+// the receive side switched on the type and decoded into a local of its
+// payload type, as the baseline server's frame handler did
+static std::size_t decode(const message::frame_header_t& header, const std::uint8_t * buf)
+{
+  switch (header.type) {
+  case message::type_t::_field: {
+    tetris::field field;
+    field::decode(buf, field);
+    return field[0][0].color != tetris::tet::empty;
+  }
+  case message::type_t::_next_piece:
+  case message::type_t::_move:
+  case message::type_t::_drop: {
+    tetris::piece piece;
+    piece::decode(buf, piece);
+    return piece.pos.u;
+  }
+  case message::type_t::_attack: {
+    tetris::attack_t attack;
+    attack::decode(buf, attack);
+    return attack.rows;
+  }
+  case message::type_t::_input: {
+    message::input_t input;
+    input::decode(buf, input);
+    return input.seq;
+  }
+  case message::type_t::_ping:
+  case message::type_t::_pong: {
+    message::sync_t sync;
+    sync::decode(buf, sync);
+    return sync.origin;
+  }
+  default:
+    throw "baseline decode";
+  }
+}
+
+}
+
+struct count_handler {
+  std::size_t& n;
+
+  template <message::type_t T, typename V>
+  void operator()(message::tag<T>, const message::frame_header_t&, V&)
+  {
+    n++;
+  }
+};
+
+template <typename Encode>
+static double time_encode(message::frame_header_t header, long messages, uint8_t * buf, Encode encode)
+{
+  const uint64_t start = message::monotonic_ns();
+  std::size_t bytes = 0;
+  for (long i = 0; i < messages; i++) {
+    header.seq = i;
+    bytes += encode(header, buf);
+  }
+  sink = bytes;
+  return static_cast<double>(message::monotonic_ns() - start) / messages;
+}
+
+template <typename Decode>
+static double time_parse(const uint8_t * buf, uint16_t frame_size, long messages, Decode decode)
+{
+  // a ring as recv leaves it, refilled once it has been parsed
+  constexpr std::size_t ring_size = 65536;
+  ring_buffer ring(ring_size);
+  const std::size_t per_fill = ring_size / frame_size;
+  for (std::size_t i = 0; i < per_fill; i++)
+    ring.write(buf, frame_size);
+  const std::size_t filled = ring.size();
+
+  static uint8_t scratch[message::max_frame_size];
+  std::size_t handled = 0;
+  const uint64_t start = message::monotonic_ns();
+  for (long i = 0; i < messages; i++) {
+    if (ring.empty()) {
+      ring.head = 0;
+      ring.tail = filled;
+    }
+    message::frame_t frame;
+    if (message::parse(ring, frame, scratch) != message::parse_result::frame)
+      throw "parse";
+    handled += decode(frame);
+    ring.consume(frame.size);
+  }
+  sink = handled;
+  return static_cast<double>(message::monotonic_ns() - start) / messages;
+}
+
+template <message::type_t T>
+static void bench(const char * name, bool extended, const typename message::schema<T>::value_type& value, long messages)
+{
+  message::frame_header_t header = message::header<T>(tetris::side_t::zero);
+  header.extended = extended;
+  header.time = 1;
+  const message::next_t next{value};
+  const uint16_t frame_size = message::frame_header::size_of(header) + header.next_length;
+  static uint8_t buf[message::max_frame_size];
+
+  const double baseline_encode_ns = time_encode(header, messages, buf, [&next](const message::frame_header_t& h, uint8_t * b) {
+    return baseline::encode(h, next, b);
+  });
+  const double encode_ns = time_encode(header, messages, buf, [&next](const message::frame_header_t& h, uint8_t * b) {
+    return message::encode(h, next, b);
+  });
+  const double typed_encode_ns = time_encode(header, messages, buf, [&value](const message::frame_header_t& h, uint8_t * b) {
+    return message::encode<T>(h, value, b);
+  });
+
+  const double baseline_parse_ns = time_parse(buf, frame_size, messages, [](const message::frame_t& frame) {
+    return baseline::decode(frame.header, frame.next);
+  });
+  const double parse_ns = time_parse(buf, frame_size, messages, [](const message::frame_t& frame) {
+    std::size_t n = 0;
+    message::dispatch(frame.header, frame.next, count_handler{n});
+    return n;
+  });
+
+  std::cout << name << (extended ? "_extended" : "") << " bytes " << frame_size
+            << " encode_baseline_ns " << baseline_encode_ns << " encode_ns " << encode_ns
+            << " encode_typed_ns " << typed_encode_ns
+            << " parse_baseline_ns " << baseline_parse_ns << " parse_ns " << parse_ns << '\n';
+}
+
+int main(int argc, char * argv[])
+{
+  const long messages = argc > 1 ? std::stol(argv[1]) : 10'000'000;
+
+  tetris::frame frame{};
+  tetris::init(frame);
+  tetris::next_piece(frame);
+  const message::input_t input{tetris::event::left, 0, 1};
+  const tetris::attack_t attack{2, 3};
+  const message::sync_t sync{1, 2, 3};
+
+  for (bool extended : {false, true}) {
+    bench<message::_field>("field", extended, frame.field, messages / 10);
+    bench<message::_move>("move", extended, frame.piece, messages);
+    bench<message::_attack>("attack", extended, attack, messages);
+    bench<message::_input>("input", extended, input, messages);
+    bench<message::_ping>("ping", extended, sync, messages);
+  }
+  return 0;
+}
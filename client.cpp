@@ -1,26 +1,73 @@
 #include <chrono>
 #include <cstring>
-#include <iostream>
+#include <deque>
 #include <mutex>
 #include <thread>
+#include <atomic>
 #include <cassert>
+#include <cstdlib>
 
 #include "bswap.hpp"
 #include "client.hpp"
+#include "clock_sync.hpp"
+#include "histogram.hpp"
+#include "log.hpp"
 #include "message.hpp"
 #include "platform_socket.hpp"
+#ifndef _WIN32
+#include "local_socket.hpp"
+#endif
 
 #define THIS_FRAME (tetris::frames[static_cast<int>(tetris::this_side)])
 
 struct state {
   int fd;
   std::thread* thread;
+  bool input_protocol; // send tetris::event inputs; the server simulates our side
+  uint32_t input_seq; // of our latest _input on this connection
+  tetris::time_point epoch;
+  std::atomic<bool> extended; // server accepted caps::extended_header
+  std::atomic<uint32_t> seq;
+  const char* socket; // TETRIS_SOCKET: the server's unix socket, instead of TCP
+  const char* room; // TETRIS_ROOM, or nullptr for the server's default room
+  bool spectate; // TETRIS_SPECTATE: watch the room instead of playing in it
+  bool joined; // frames before the _join reply belong to the default room
+  tetris::side_t resumed; // side whose field the server sent ahead of our _side
+  clock_sync clock; // from our _ping frames and the server's _pong replies
+  uint64_t pinged; // monotonic_ns() of our latest _ping
 };
 
 static state state;
 
+// input protocol: inputs the server has yet to apply, each with our side's
+// frame as it was before it. a _correct rebases our prediction onto the
+// server's piece and replays them. the game thread predicts and the
+// network thread rebases, under prediction
+struct unacked_input {
+  uint32_t seq;
+  tetris::event event;
+  tetris::frame before;
+};
+
+static std::deque<unacked_input> unacked;
+static std::mutex prediction;
+
+// latency of traced frames from other sides, in nanoseconds from the origin
+// send, and round trips to the server
+static struct {
+  histogram recv;   // origin send -> recv here
+  histogram render; // origin send -> first frame rendered after recv
+  histogram rtt;    // our _ping -> the server's _pong, less its turnaround
+  std::atomic<uint64_t> unrendered; // origin time of the latest frame not yet rendered
+  std::atomic<int64_t> offset; // the server's clock less ours
+} latency;
+
+constexpr uint64_t ping_interval_ns = 1'000'000'000;
+constexpr int server_timeout_s = 10; // a server that pings and then goes silent this long is gone
+
 constexpr const char* server_addr = "localhost";
 constexpr const char* server_port = "5000";
+constexpr std::size_t recv_size = 65536;
 
 int reconnect()
 {
@@ -30,10 +77,31 @@ int reconnect()
   if (state.fd >= 0) {
     ret = close(state.fd);
     if (ret < 0)
-      std::cerr << "close: " << std::strerror(errno) << '\n';
+      LOG(warn, net, "close: " << std::strerror(errno));
     state.fd = -1;
   }
 
+  #ifndef _WIN32
+  if (state.socket != nullptr) {
+    struct sockaddr_un addr;
+    socklen_t addrlen = local_address(state.socket, addr);
+    fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+      LOG(warn, net, "socket: " << std::strerror(errno));
+      return -1;
+    }
+    ret = connect(fd, (struct sockaddr *)&addr, addrlen);
+    if (ret < 0) {
+      LOG(warn, net, "connect: " << state.socket << ' ' << std::strerror(errno));
+      close(fd);
+      return -1;
+    }
+    state.fd = fd;
+    LOG(info, client, "connected to " << state.socket);
+    return 0;
+  }
+  #endif
+
   struct addrinfo *result, *rp;
   struct addrinfo hints{};
   hints.ai_family = AF_UNSPEC;
@@ -41,14 +109,14 @@ int reconnect()
   hints.ai_protocol = IPPROTO_TCP;
   ret = getaddrinfo(server_addr, server_port, &hints, &result);
   if (ret != 0) {
-    std::cerr << "getaddrinfo: " << gai_strerror(ret) << '\n';
+    LOG(warn, net, "getaddrinfo: " << gai_strerror(ret));
     return -1;
   }
 
   for (rp = result; rp != NULL; rp = rp->ai_next) {
     fd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
     if (fd < 0) {
-      std::cerr << "socket: " << std::strerror(errno) << '\n';
+      LOG(warn, net, "socket: " << std::strerror(errno));
       continue;
     }
 
@@ -73,9 +141,9 @@ int reconnect()
       if (cret == nullptr)
         throw "inet_ntop";
 
-      std::cerr << "connect: " << '[' << saddr << "]:" << bswap::ntoh(nport) << ' ' << std::strerror(errno) << '\n';
+      LOG(warn, net, "connect: " << '[' << saddr << "]:" << bswap::ntoh(nport) << ' ' << std::strerror(errno));
       #ifdef _WIN32
-      std::cerr << "WSAGetLastError: " << WSAGetLastError() << '\n';
+      LOG(warn, net, "WSAGetLastError: " << WSAGetLastError());
       #endif
       close(fd);
       fd = -1;
@@ -85,225 +153,475 @@ int reconnect()
 
   if (fd != -1) {
     state.fd = fd;
-    std::cerr << "connected\n";
+    LOG(info, client, "connected");
     return 0;
   } else {
     return -1;
   }
 }
 
-static void send_frame(const message::frame_header_t& header, const message::next_t& next)
+static void send_frame(message::frame_header_t header, const message::next_t& next)
 {
   assert(state.fd != -1);
 
+  if (state.extended) {
+    header.extended = true;
+    header.seq = ++state.seq;
+    header.time = message::monotonic_ns();
+  }
+
   uint8_t buf[4096];
   size_t buf_length = message::encode(header, next, buf);
 
   ssize_t ret = send(state.fd, buf, buf_length, 0);
   if (ret < 0) {
-    std::cerr << "send: " << std::strerror(errno) << '\n';
+    LOG(warn, net, "send: " << std::strerror(errno));
   }
 }
 
+// control frames have no side of their own, but a baseline server checks
+// the side of every frame before it looks at the type; it accepts zero, then
+// logs and skips a type it does not know
+constexpr tetris::side_t control_side = tetris::side_t::zero;
+
+static void event_hello(uint32_t caps)
+{
+  message::frame_header_t header = message::header<message::_hello>(control_side);
+
+  send_frame(header, message::next_t{caps});
+}
+
+static void event_join(uint32_t room_id)
+{
+  message::frame_header_t header = message::header<message::_join>(control_side);
+
+  send_frame(header, message::next_t{room_id});
+}
+
+static void event_spectate(uint32_t room_id)
+{
+  message::frame_header_t header = message::header<message::_spectate>(control_side);
+
+  send_frame(header, message::next_t{room_id});
+}
+
+static void event_ping()
+{
+  message::frame_header_t header = message::header<message::_ping>(control_side);
+
+  state.pinged = message::monotonic_ns();
+  send_frame(header, message::next_t{message::sync_t{state.pinged, 0, 0}});
+}
+
+static void event_pong(const message::sync_t& pong)
+{
+  message::frame_header_t header = message::header<message::_pong>(control_side);
+
+  send_frame(header, message::next_t{pong});
+}
+
 static void event_field(tetris::field& field, tetris::side_t side)
 {
-  message::frame_header_t header;
-  header.type = message::type_t::_field;
-  header.side = side;
-  header.next_length = message::field::size;
+  message::frame_header_t header = message::header<message::_field>(side);
 
   send_frame(header, message::next_t{field});
 }
 
 static void event_next_piece(tetris::piece& piece, tetris::side_t side)
 {
-  message::frame_header_t header;
-  header.type = message::type_t::_next_piece;
-  header.side = side;
-  header.next_length = message::piece::size;
+  message::frame_header_t header = message::header<message::_next_piece>(side);
 
   send_frame(header, message::next_t{piece});
 }
 
 static void event_move(tetris::piece& piece, tetris::side_t side)
 {
-  message::frame_header_t header;
-  header.type = message::type_t::_move;
-  header.side = side;
-  header.next_length = message::piece::size;
+  message::frame_header_t header = message::header<message::_move>(side);
 
   send_frame(header, message::next_t{piece});
 }
 
 static void event_drop(tetris::piece& piece, tetris::side_t side)
 {
-  message::frame_header_t header;
-  header.type = message::type_t::_drop;
-  header.side = side;
-  header.next_length = message::piece::size;
+  message::frame_header_t header = message::header<message::_drop>(side);
 
   send_frame(header, message::next_t{piece});
 }
 
-static void loop()
+static void event_input(tetris::event ev)
 {
-  while (1) {
-    if (state.fd == -1) {
-      while (reconnect() < 0) {
-        std::this_thread::sleep_for(std::chrono::milliseconds(2000));
-      }
-    }
+  message::frame_header_t header = message::header<message::_input>(tetris::this_side);
 
-    ssize_t ret;
-    uint8_t buf_header[message::frame_header::size];
-    ret = recv(state.fd, buf_header, message::frame_header::size, 0);
-    if (ret <= 0) {
-      if (ret < 0) std::cerr << "recv: " << std::strerror(errno) << '\n';
-      close(state.fd);
-      state.fd = -1;
-      continue;
-    }
-    assert(ret == message::frame_header::size);
-
-    message::frame_header_t header = message::frame_header::decode(buf_header);
-    uint8_t buf_frame[header.next_length];
-    if (header.next_length != 0) {
-      ret = recv(state.fd, buf_frame, header.next_length, 0);
-      if (ret <= 0) {
-        if (ret < 0) std::cerr << "recv: " << std::strerror(errno) << '\n';
-        close(state.fd);
-        state.fd = -1;
-        continue;
-      }
-      assert(ret == header.next_length);
-    }
+  auto time = std::chrono::duration_cast<std::chrono::milliseconds>(tetris::clock::now() - state.epoch);
+  message::input_t input{ev, static_cast<uint32_t>(time.count()), ++state.input_seq};
+  unacked.push_back({input.seq, ev, THIS_FRAME});
+  send_frame(header, message::next_t{input});
+}
 
-    assert(static_cast<int>(header.side) < tetris::frame_count);
-    switch (header.type) {
-    case message::type_t::_field:
-      //std::cerr << "message _field " << (int)header.side << '\n';
-      assert(header.side != tetris::this_side);
-      assert(header.next_length == message::field::size);
-      message::field::decode(buf_frame, tetris::frames[(int)header.side].field);
-      break;
-    case message::type_t::_side:
-      //std::cerr << "message _side " << (int)header.side << '\n';
-      assert(header.next_length == 0);
-      assert(tetris::this_side == tetris::side_t::none);
+// derived state is only sent when the server does not simulate our side
 
-      tetris::this_side = header.side;
-      tetris::event_reset_frame(header.side);
-      event_field(tetris::frames[(int)header.side].field, header.side);
-      event_move(tetris::frames[(int)header.side].piece, header.side);
+static void sync_move()
+{
+  if (!state.input_protocol)
+    event_move(THIS_FRAME.piece, tetris::this_side);
+}
 
-      break;
-    case message::type_t::_next_piece:
-      assert(header.side != tetris::this_side);
-      assert(header.next_length == message::piece::size);
-      tetris::_garbage(tetris::frames[(int)header.side].field, tetris::frames[(int)header.side].garbage);
-      message::piece::decode(buf_frame, tetris::frames[(int)header.side].piece);
-      break;
-    case message::type_t::_move:
-      //std::cerr << "message _move " << (int)header.side << '\n';
-      assert(header.side != tetris::this_side);
-      assert(header.next_length == message::piece::size);
-      message::piece::decode(buf_frame, tetris::frames[(int)header.side].piece);
-      break;
-    case message::type_t::_drop:
-      //std::cerr << "message _move " << (int)header.side << '\n';
-      assert(header.side != tetris::this_side);
-      assert(header.next_length == message::piece::size);
-      message::piece::decode(buf_frame, tetris::frames[(int)header.side].piece);
-      tetris::place(tetris::frames[(int)header.side]);
-      break;
-    case message::type_t::_attack:
-    {
-      // no header.side assert
-      std::cerr << "recv attack " << (int)header.side << '\n';
-      assert(header.next_length == message::attack::size);
-      tetris::attack_t attack;
-      message::attack::decode(buf_frame, attack);
-      tetris::attack(tetris::frames[(int)header.side], attack);
-      break;
-    }
-    default:
-      std::cerr << "unhandled frame type " << header.type << '\n';
-      break;
-    }
-  }
+static void sync_drop()
+{
+  if (!state.input_protocol)
+    event_drop(THIS_FRAME.piece, tetris::this_side);
 }
 
-void client::input(tetris::event ev)
+static void sync_next_piece()
 {
-  if (tetris::this_side == tetris::side_t::none)
-    return;
+  if (!state.input_protocol)
+    event_next_piece(THIS_FRAME.piece, tetris::this_side);
+}
 
+// a piece with no room to spawn ends the game, and the side starts over;
+// the server does the same for a side it simulates
+static void top_out()
+{
+  tetris::event_reset_frame(tetris::this_side);
+  if (!state.input_protocol)
+    event_field(THIS_FRAME.field, tetris::this_side);
+}
+
+// one input on our side's frame
+static void simulate(tetris::event ev)
+{
   switch (ev) {
   case tetris::event::left:
     if (tetris::move({-1, 0}, 0))
-      event_move(THIS_FRAME.piece, tetris::this_side);
+      sync_move();
     break;
   case tetris::event::right:
     if (tetris::move({1, 0}, 0))
-      event_move(THIS_FRAME.piece, tetris::this_side);
+      sync_move();
     break;
   case tetris::event::down:
     if (tetris::move({0, -1}, 0))
-      event_move(THIS_FRAME.piece, tetris::this_side);
+      sync_move();
     break;
   case tetris::event::drop:
     tetris::drop();
-    event_drop(THIS_FRAME.piece, tetris::this_side);
-    tetris::next_piece();
-    event_next_piece(THIS_FRAME.piece, tetris::this_side);
+    sync_drop();
+    tetris::_garbage(THIS_FRAME.field, THIS_FRAME.garbage);
+    if (!tetris::next_piece())
+      top_out();
+    sync_next_piece();
     break;
   case tetris::event::spin_cw:
     if (tetris::move({0, 0}, 1))
-      event_move(THIS_FRAME.piece, tetris::this_side);
+      sync_move();
     break;
   case tetris::event::spin_ccw:
     if (tetris::move({0, 0}, -1))
-      event_move(THIS_FRAME.piece, tetris::this_side);
+      sync_move();
     break;
   case tetris::event::spin_180:
     //if (tetris::move({0, 0}, 2))
-    //  event_move(THIS_FRAME.piece, tetris::this_side);
+    //  sync_move();
     break;
   case tetris::event::swap:
     if (!THIS_FRAME.swapped) {
-      tetris::swap();
-      event_move(THIS_FRAME.piece, tetris::this_side);
+      if (!tetris::swap())
+        top_out();
+      sync_move();
     }
     break;
   default:
-    std::cerr << "unhandled input ev " << static_cast<int>(ev) << '\n';
+    LOG(warn, client, "unhandled input ev " << static_cast<int>(ev));
     break;
   }
 }
 
+// the local simulation doubles as prediction in the input protocol
+static void step(tetris::event ev)
+{
+  if (state.input_protocol)
+    event_input(ev);
+  simulate(ev);
+}
+
+struct frame_handler {
+  void operator()(message::tag<message::_hello>, const message::frame_header_t& header, uint32_t& caps)
+  {
+    state.extended = (caps & message::caps::extended_header) != 0;
+    if ((caps & message::caps::ping) != 0) {
+      // its pings are the server's heartbeat; without them recv times out
+      // and we reconnect, rather than wait on a half-open connection
+#ifdef _WIN32
+      DWORD timeout = server_timeout_s * 1000;
+#else
+      struct timeval timeout = {server_timeout_s, 0};
+#endif
+      if (setsockopt(state.fd, SOL_SOCKET, SO_RCVTIMEO, (const char *)&timeout, (sizeof (timeout))) < 0)
+        LOG(warn, net, "setsockopt: SO_RCVTIMEO: " << std::strerror(errno));
+    }
+  }
+
+  // the server pings every client; ours ride along with the replies, so
+  // the receive loop needs no timer of its own
+  void operator()(message::tag<message::_ping>, const message::frame_header_t& header, message::sync_t& ping)
+  {
+    event_pong(clock_sync::pong(ping, message::monotonic_ns()));
+    if (message::monotonic_ns() - state.pinged >= ping_interval_ns)
+      event_ping();
+  }
+
+  void operator()(message::tag<message::_pong>, const message::frame_header_t& header, message::sync_t& pong)
+  {
+    latency.rtt.record(state.clock.add(pong, message::monotonic_ns()));
+    latency.offset.store(state.clock.offset, std::memory_order_relaxed);
+  }
+
+  void operator()(message::tag<message::_join>, const message::frame_header_t& header, uint32_t& room_id)
+  {
+    LOG(info, client, "joined room " << room_id);
+    state.joined = true;
+  }
+
+  void operator()(message::tag<message::_spectate>, const message::frame_header_t& header, uint32_t& room_id)
+  {
+    LOG(info, client, "watching room " << room_id);
+    state.joined = true;
+  }
+
+  void operator()(message::tag<message::_field>, const message::frame_header_t& header, tetris::field& field)
+  {
+    //std::cerr << "message _field " << (int)header.side << '\n';
+    if (header.side == tetris::this_side) {
+      // the server started our side over; the _correct that follows
+      // replays what it has yet to apply on the new field
+      assert(state.input_protocol);
+      std::lock_guard<std::mutex> lock(prediction);
+      THIS_FRAME.field = field;
+      for (auto& input : unacked)
+        input.before.field = field;
+      return;
+    }
+    tetris::frames[(int)header.side].field = field;
+    // before our _side, a field can only be a match kept across a server restart
+    if (tetris::this_side == tetris::side_t::none && !state.spectate)
+      state.resumed = header.side;
+  }
+
+  void operator()(message::tag<message::_side>, const message::frame_header_t& header, std::monostate&)
+  {
+    //std::cerr << "message _side " << (int)header.side << '\n';
+    assert(tetris::this_side == tetris::side_t::none);
+
+    tetris::this_side = header.side;
+    {
+      std::lock_guard<std::mutex> lock(prediction);
+      unacked.clear();
+    }
+    if (state.resumed != header.side)
+      tetris::event_reset_frame(header.side);
+    state.resumed = tetris::side_t::none;
+    event_field(tetris::frames[(int)header.side].field, header.side);
+    event_move(tetris::frames[(int)header.side].piece, header.side);
+  }
+
+  void operator()(message::tag<message::_next_piece>, const message::frame_header_t& header, tetris::piece& piece)
+  {
+    assert(header.side != tetris::this_side);
+    tetris::_garbage(tetris::frames[(int)header.side].field, tetris::frames[(int)header.side].garbage);
+    tetris::frames[(int)header.side].piece = piece;
+  }
+
+  void operator()(message::tag<message::_move>, const message::frame_header_t& header, tetris::piece& piece)
+  {
+    //std::cerr << "message _move " << (int)header.side << '\n';
+    assert(header.side != tetris::this_side);
+    tetris::frames[(int)header.side].piece = piece;
+  }
+
+  void operator()(message::tag<message::_drop>, const message::frame_header_t& header, tetris::piece& piece)
+  {
+    assert(header.side != tetris::this_side);
+    tetris::frames[(int)header.side].piece = piece;
+    tetris::place(tetris::frames[(int)header.side]);
+  }
+
+  void operator()(message::tag<message::_attack>, const message::frame_header_t& header, tetris::attack_t& attack)
+  {
+    // no header.side assert
+    LOG(debug, client, "recv attack " << (int)header.side);
+    if (header.side == tetris::this_side) {
+      // the server has it ahead of the inputs it has yet to apply
+      std::lock_guard<std::mutex> lock(prediction);
+      for (auto& input : unacked)
+        tetris::attack(input.before, attack);
+    }
+    tetris::attack(tetris::frames[(int)header.side], attack);
+  }
+
+  // the server applied our inputs up to correct.seq and has correct.piece
+  // where we predicted ours
+  void operator()(message::tag<message::_correct>, const message::frame_header_t& header, message::correct_t& correct)
+  {
+    assert(state.input_protocol);
+    std::lock_guard<std::mutex> lock(prediction);
+    while (!unacked.empty() && unacked.front().seq <= correct.seq)
+      unacked.pop_front();
+    tetris::frame frame = unacked.empty() ? THIS_FRAME : unacked.front().before;
+    if (!tetris::fits(frame.field, correct.piece)) {
+      // only garbage that arrived out of order gets our field this far off
+      LOG(warn, client, "correction " << correct.seq << " does not fit our field");
+      return;
+    }
+    // the piece's lock delay and the gravity timer stay ours
+    correct.piece.lock_delay = THIS_FRAME.piece.lock_delay;
+    frame.piece = correct.piece;
+    frame.point = THIS_FRAME.point;
+    THIS_FRAME = frame;
+    for (auto& input : unacked) {
+      input.before = THIS_FRAME;
+      simulate(input.event);
+    }
+  }
+
+  template <message::type_t T, typename V>
+  void operator()(message::tag<T>, const message::frame_header_t& header, V&)
+  {
+    LOG(warn, client, "unhandled frame type " << header.type);
+  }
+};
+
+static ring_buffer stream(recv_size);
+static uint8_t scratch[message::max_frame_size];
+
+static void disconnect()
+{
+  close(state.fd);
+  state.fd = -1;
+  stream.clear();
+  // the next server hands out a side again, perhaps with our field
+  tetris::this_side = tetris::side_t::none;
+  state.resumed = tetris::side_t::none;
+  // and numbers our inputs from 1
+  state.input_seq = 0;
+  {
+    std::lock_guard<std::mutex> lock(prediction);
+    unacked.clear();
+  }
+  // the next server has a clock of its own
+  state.clock = clock_sync{};
+  state.pinged = 0;
+}
+
+static void loop()
+{
+  while (1) {
+    if (state.fd == -1) {
+      while (reconnect() < 0) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(2000));
+      }
+      // a baseline server skips _hello and never answers it, so we keep
+      // sending plain headers. it skips _join and _spectate as well, and
+      // TETRIS_ROOM then waits for a reply that never comes
+      state.extended = false;
+      state.joined = state.room == nullptr && !state.spectate;
+      event_hello(message::caps::extended_header | message::caps::ping | (state.joined ? 0 : message::caps::join));
+      const uint32_t room_id = state.room != nullptr ? std::strtoul(state.room, nullptr, 10) : 0;
+      if (state.spectate)
+        event_spectate(room_id);
+      else if (!state.joined)
+        event_join(room_id);
+    }
+
+    // one recv takes as many frames as have arrived, up to the ring's free space
+    ssize_t ret = recv(state.fd, stream.write_ptr(), stream.write_len(), 0);
+    if (ret <= 0) {
+      if (ret < 0) LOG(warn, net, "recv: " << std::strerror(errno));
+      disconnect();
+      continue;
+    }
+    stream.commit(ret);
+
+    message::frame_t frame;
+    message::parse_result result;
+    while ((result = message::parse(stream, frame, scratch)) == message::parse_result::frame) {
+      const message::frame_header_t& header = frame.header;
+
+      if (header.extended) {
+        // traces arrive on the server's timeline
+        const uint64_t origin_time = state.clock.local(header.time);
+        latency.recv.record(message::monotonic_ns() - origin_time);
+        latency.unrendered.store(origin_time, std::memory_order_relaxed);
+      }
+
+      const bool control = header.type == message::type_t::_hello || header.type == message::type_t::_join
+        || header.type == message::type_t::_spectate || header.type == message::type_t::_ping
+        || header.type == message::type_t::_pong;
+
+      if (!state.joined && !control) {
+        stream.consume(frame.size);
+        continue;
+      }
+
+      if (!control)
+        assert(static_cast<int>(header.side) < tetris::frame_count);
+
+      if (!message::dispatch(header, frame.next, frame_handler{}))
+        LOG(warn, net, "bad frame type " << header.type << " length " << header.next_length);
+
+      stream.consume(frame.size);
+    }
+    if (result == message::parse_result::error) {
+      LOG(warn, net, "bad frame length " << frame.header.next_length);
+      disconnect();
+    }
+  }
+}
+
+void client::input(tetris::event ev)
+{
+  if (tetris::this_side == tetris::side_t::none)
+    return;
+
+  std::lock_guard<std::mutex> lock(prediction);
+  step(ev);
+}
+
 
 void client::tick()
 {
   if (tetris::this_side == tetris::side_t::none)
     return;
 
+  std::lock_guard<std::mutex> lock(prediction);
   if (!tetris::gravity(THIS_FRAME))
     return;
 
-  if (tetris::move({0, -1}, 0)) {
+  tetris::piece lowered = THIS_FRAME.piece;
+  lowered.pos.v--;
+  if (tetris::fits(THIS_FRAME.field, lowered)) {
     THIS_FRAME.piece.lock_delay.locking = false;
-    event_move(THIS_FRAME.piece, tetris::this_side);
-  } else {
-    if (!tetris::lock_delay(THIS_FRAME.piece)) {
-      tetris::drop();
-      event_drop(THIS_FRAME.piece, tetris::this_side);
-      tetris::_garbage(THIS_FRAME.field, THIS_FRAME.garbage);
-      tetris::next_piece();
-      event_next_piece(THIS_FRAME.piece, tetris::this_side);
-    }
+    step(tetris::event::down);
+  } else if (!tetris::lock_delay(THIS_FRAME.piece)) {
+    // the piece rests on its drop row, so a locked piece is a drop
+    step(tetris::event::drop);
   }
 }
 
+void client::rendered()
+{
+  uint64_t time = latency.unrendered.exchange(0, std::memory_order_relaxed);
+  if (time != 0)
+    latency.render.record(message::monotonic_ns() - time);
+}
+
+void client::dump_latency(std::ostream& os)
+{
+  latency.recv.dump(os, "latency_recv_ns");
+  latency.render.dump(os, "latency_render_ns");
+  latency.rtt.dump(os, "latency_rtt_ns");
+  os << "clock_offset_ns " << latency.offset.load(std::memory_order_relaxed) << '\n';
+}
+
 void client::init()
 {
   #ifdef _WIN32
@@ -313,6 +631,13 @@ void client::init()
   #endif
 
   state.fd = -1;
+  state.resumed = tetris::side_t::none;
+  const char* protocol = std::getenv("TETRIS_PROTOCOL");
+  state.input_protocol = protocol != nullptr && std::strcmp(protocol, "input") == 0;
+  state.epoch = tetris::clock::now();
+  state.socket = std::getenv("TETRIS_SOCKET");
+  state.room = std::getenv("TETRIS_ROOM");
+  state.spectate = std::getenv("TETRIS_SPECTATE") != nullptr;
   state.thread = new std::thread(loop);
 
   // WSACleanup();
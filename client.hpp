@@ -1,9 +1,13 @@
 #pragma once
 
+#include <ostream>
+
 #include "tetris.hpp"
 
 namespace client {
   void input(tetris::event ev);
   void tick();
+  void rendered();
+  void dump_latency(std::ostream& os);
   void init();
 }
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+
+#include "message.hpp"
+
+// round trip time and clock offset to a peer, ntp style. a _ping leaves at
+// t0 on our clock and arrives at t1 on the peer's; its _pong leaves at t2
+// on the peer's clock and arrives at t3 on ours. then
+//
+//   rtt    = (t3 - t0) - (t2 - t1)
+//   offset = ((t1 - t0) + (t2 - t3)) / 2, the peer's clock less ours
+//
+// the offset is wrong by half the difference between the two legs, which
+// is at most rtt / 2, so it comes from the sample with the least rtt of the
+// last few. an offset within that bound is no offset at all: peers on one
+// host share a clock, and their timestamps are used as they are
+
+struct clock_sync
+{
+  static constexpr int window = 8; // samples
+
+  struct sample {
+    uint64_t rtt = UINT64_MAX;
+    int64_t offset = 0;
+  };
+
+  std::array<sample, window> samples;
+  int next = 0;
+  uint64_t rtt = 0; // of the latest sample
+  int64_t offset = 0;
+
+  // add the sample carried by a _pong received at t3; returns its rtt
+  uint64_t add(const message::sync_t& pong, uint64_t t3)
+  {
+    const uint64_t elapsed = t3 - pong.origin;
+    const uint64_t turnaround = pong.transmit - pong.receive;
+    sample& s = samples[next];
+    next = (next + 1) % window;
+    s.rtt = elapsed > turnaround ? elapsed - turnaround : 0;
+    s.offset = (static_cast<int64_t>(pong.receive - pong.origin) + static_cast<int64_t>(pong.transmit - t3)) / 2;
+    rtt = s.rtt;
+
+    const sample * best = &samples[0];
+    for (const sample& other : samples)
+      if (other.rtt < best->rtt)
+        best = &other;
+    const uint64_t bound = best->rtt / 2;
+    offset = (best->offset > static_cast<int64_t>(bound) || best->offset < -static_cast<int64_t>(bound)) ? best->offset : 0;
+    return rtt;
+  }
+
+  // a peer timestamp on our clock
+  uint64_t local(uint64_t peer_time) const
+  {
+    return peer_time - offset;
+  }
+
+  // a _pong answering ping, received at receive
+  static message::sync_t pong(const message::sync_t& ping, uint64_t receive)
+  {
+    return {ping.origin, receive, message::monotonic_ns()};
+  }
+};
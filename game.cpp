@@ -1708,6 +1708,7 @@ void loop() {
     input::poll_gamepads();
     client::tick();
     drawFrame();
+    client::rendered();
 
     // fps counting
 
@@ -1730,6 +1731,7 @@ void loop() {
     }
   }
   std::cerr << "should close\n";
+  client::dump_latency(std::cerr);
 
   vkDeviceWaitIdle(logicalDevice);
 }
@@ -0,0 +1,73 @@
+#include <atomic>
+#include <bit>
+#include <cstdint>
+#include <ostream>
+
+#include "histogram.hpp"
+
+static inline int _bucket_index(uint64_t value)
+{
+  if (value < histogram::sub_count)
+    return value;
+  int exponent = 63 - std::countl_zero(value);
+  int mantissa = value >> (exponent - histogram::sub_bits);
+  return (exponent - histogram::sub_bits + 1) * histogram::sub_count + (mantissa - histogram::sub_count);
+}
+
+static inline uint64_t _bucket_value(int index)
+{
+  if (index < histogram::sub_count)
+    return index;
+  int exponent = index / histogram::sub_count + histogram::sub_bits - 1;
+  uint64_t mantissa = index % histogram::sub_count + histogram::sub_count;
+  return mantissa << (exponent - histogram::sub_bits);
+}
+
+static inline void _add(std::atomic<uint64_t>& a, uint64_t n)
+{
+  a.store(a.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+void histogram::record(uint64_t value)
+{
+  _add(counts[_bucket_index(value)], 1);
+  _add(total, 1);
+  if (value > max.load(std::memory_order_relaxed))
+    max.store(value, std::memory_order_relaxed);
+}
+
+void histogram::merge(const histogram& other)
+{
+  for (int i = 0; i < bucket_count; i++)
+    _add(counts[i], other.counts[i].load(std::memory_order_relaxed));
+  _add(total, other.total.load(std::memory_order_relaxed));
+  uint64_t other_max = other.max.load(std::memory_order_relaxed);
+  if (other_max > max.load(std::memory_order_relaxed))
+    max.store(other_max, std::memory_order_relaxed);
+}
+
+uint64_t histogram::percentile(double p) const
+{
+  const uint64_t n = total.load(std::memory_order_relaxed);
+  if (n == 0)
+    return 0;
+  uint64_t rank = static_cast<uint64_t>(p / 100.0 * static_cast<double>(n));
+  if (rank >= n)
+    rank = n - 1;
+  uint64_t seen = 0;
+  for (int i = 0; i < bucket_count; i++) {
+    seen += counts[i].load(std::memory_order_relaxed);
+    if (seen > rank)
+      return _bucket_value(i);
+  }
+  return max.load(std::memory_order_relaxed);
+}
+
+void histogram::dump(std::ostream& os, const char * name) const
+{
+  os << name << " count " << total.load(std::memory_order_relaxed)
+     << " p50 " << percentile(50.0)
+     << " p99 " << percentile(99.0)
+     << " p999 " << percentile(99.9)
+     << " max " << max.load(std::memory_order_relaxed) << '\n';
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <ostream>
+
+// log-linear buckets in the style of HdrHistogram: each power of two is
+// split into 16 linear sub-buckets, so any value is within ~6% of its bucket.
+// record() has a single writer; other threads may read concurrently.
+
+struct histogram
+{
+  static constexpr int sub_bits = 4;
+  static constexpr int sub_count = 1 << sub_bits;
+  static constexpr int bucket_count = (64 - sub_bits + 1) * sub_count;
+
+  std::array<std::atomic<uint64_t>, bucket_count> counts{};
+  std::atomic<uint64_t> total = 0;
+  std::atomic<uint64_t> max = 0;
+
+  void record(uint64_t value);
+  void merge(const histogram& other);
+  uint64_t percentile(double p) const;
+  void dump(std::ostream& os, const char * name) const;
+};
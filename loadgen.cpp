@@ -0,0 +1,574 @@
+#include <array>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "histogram.hpp"
+#include "local_socket.hpp"
+#include "message.hpp"
+#include "ring.hpp"
+#include "shm.hpp"
+#include "tetris.hpp"
+
+// synthetic load for server: many bot connections on one epoll loop, each
+// speaking the real protocol. rooms hold two players and a share of
+// _spectate subscribers; players send _input at a fixed move and drop rate and every
+// connection measures the latency of the traced frames it receives, and
+// answers the server's _ping. with -u the bots take shared-memory channels
+// from the server's unix socket instead of TCP, and -a with a path connects
+// to its plain unix socket. with -P the report includes the server's cost,
+// as matches one core could simulate at these input rates. with -L the bots
+// speak the baseline protocol: no _hello or _join, so they all land in the
+// default room and most of them only receive
+
+static void passert(int ret, const char* s)
+{
+  if (ret < 0) {
+    std::cerr << s << ": " << std::strerror(errno) << '\n';
+    throw ret;
+  }
+}
+
+struct options {
+  const char * host = "localhost"; // or a unix socket path, "@name" for the abstract namespace
+  const char * port = "5000";
+  const char * shm_path = nullptr; // unix socket for shared-memory channels, or TCP
+  int clients = 100;
+  double duration = 10.0; // seconds
+  double move_rate = 10.0; // _input moves per second per player
+  double drop_rate = 1.0; // _input drops per second per player
+  double spectators = 0.0; // share of connections that only watch
+  int pid = 0; // server process to sample, or 0
+  bool legacy = false; // no _hello or _join
+  uint32_t first_room = 1; // rooms are numbered from here, so loadgens can run side by side
+};
+
+static options opt;
+
+constexpr std::size_t recv_size = 16384;
+constexpr std::size_t send_size = 4096;
+
+struct bot {
+  int fd;
+  std::unique_ptr<shm::channel> shm; // fd is then its doorbell socket
+  uint32_t room_id;
+  bool joined; // frames before the _join reply belong to the default room
+  bool extended;
+  uint32_t seq;
+  uint32_t inputs; // _input frames sent, for their seq
+  tetris::side_t side;
+  uint64_t next_move; // monotonic_ns()
+  uint64_t next_drop;
+  ring_buffer recv;
+  ring_buffer send;
+
+  bot()
+    : recv (recv_size)
+    , send (send_size)
+  {
+    fd = -1;
+    room_id = 0;
+    joined = false;
+    extended = false;
+    seq = 0;
+    inputs = 0;
+    side = tetris::side_t::none;
+    next_move = 0;
+    next_drop = 0;
+  }
+};
+
+static struct {
+  uint64_t frames_sent;
+  uint64_t bytes_sent;
+  uint64_t send_stalls; // frames skipped because the socket was backed up
+  std::array<uint64_t, message::_last> frames_recv;
+  uint64_t bytes_recv;
+  uint64_t disconnects;
+  std::array<histogram, message::_last> latency; // origin send -> recv, by type
+} totals;
+
+static std::default_random_engine generator (std::random_device{}());
+
+static int open_connection(const struct addrinfo * addr)
+{
+  int fd = socket(addr->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  passert(fd, "socket");
+  int ret = connect(fd, addr->ai_addr, addr->ai_addrlen);
+  passert(ret, "connect");
+  return fd;
+}
+
+static void shm_flush(bot& b)
+{
+  while (!b.send.empty()) {
+    const std::size_t len = b.shm->write(b.send.read_ptr(), b.send.read_len());
+    b.send.consume(len);
+    if (!b.send.empty() && len == 0 && b.shm->block())
+      break; // the server rings once it has made room
+  }
+  if (b.shm->wake())
+    shm::ring_doorbell(b.fd);
+}
+
+static int open_local_connection(const char * path)
+{
+  struct sockaddr_un addr;
+  socklen_t addrlen = local_address(path, addr);
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  passert(fd, "socket");
+  int ret = connect(fd, (struct sockaddr *)&addr, addrlen);
+  passert(ret, "connect");
+  return fd;
+}
+
+static void flush(bot& b)
+{
+  if (b.shm) {
+    shm_flush(b);
+    return;
+  }
+  while (!b.send.empty()) {
+    ssize_t len = ::send(b.fd, b.send.read_ptr(), b.send.read_len(), MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (len < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        std::cerr << "send: " << b.fd << ": " << std::strerror(errno) << '\n';
+      return; // EPOLLOUT resumes
+    }
+    b.send.consume(len);
+  }
+}
+
+static void send_frame(bot& b, message::frame_header_t header, const message::next_t& next)
+{
+  if (b.extended) {
+    header.extended = true;
+    header.seq = ++b.seq;
+    header.time = message::monotonic_ns();
+  }
+  uint8_t buf[message::max_frame_size];
+  size_t len = message::encode(header, next, buf);
+  if (b.send.space() < len) {
+    totals.send_stalls++;
+    return;
+  }
+  b.send.write(buf, len);
+  totals.frames_sent++;
+  totals.bytes_sent += len;
+}
+
+static void clear(tetris::field& field)
+{
+  for (auto& column : field)
+    for (auto& cell : column)
+      cell.color = tetris::tet::empty;
+}
+
+static void send_field(bot& b)
+{
+  tetris::field field;
+  clear(field);
+  send_frame(b, message::header<message::_field>(b.side), message::next_t{field});
+}
+
+static void send_input(bot& b, tetris::event ev)
+{
+  message::input_t input{ev, static_cast<uint32_t>(message::monotonic_ns() / 1'000'000), ++b.inputs};
+  send_frame(b, message::header<message::_input>(b.side), message::next_t{input});
+}
+
+// a player establishes its piece once, then hands its side to the server
+static void start_playing(bot& b, uint64_t now)
+{
+  tetris::frame frame;
+  tetris::init(frame);
+  clear(frame.field);
+  tetris::next_piece(frame);
+  send_field(b);
+  send_frame(b, message::header<message::_move>(b.side), message::next_t{frame.piece});
+
+  std::uniform_real_distribution<double> phase(0.0, 1.0);
+  if (opt.move_rate > 0)
+    b.next_move = now + static_cast<uint64_t>(phase(generator) * 1e9 / opt.move_rate);
+  if (opt.drop_rate > 0)
+    b.next_drop = now + static_cast<uint64_t>(phase(generator) * 1e9 / opt.drop_rate);
+}
+
+static void play(bot& b, uint64_t now)
+{
+  static std::bernoulli_distribution direction(0.5);
+
+  bool sent = false;
+  if (opt.move_rate > 0 && now >= b.next_move) {
+    send_input(b, direction(generator) ? tetris::event::left : tetris::event::right);
+    b.next_move += static_cast<uint64_t>(1e9 / opt.move_rate);
+    sent = true;
+  }
+  if (opt.drop_rate > 0 && now >= b.next_drop) {
+    // a full field starts over on the server
+    send_input(b, tetris::event::drop);
+    b.next_drop += static_cast<uint64_t>(1e9 / opt.drop_rate);
+    sent = true;
+  }
+  if (sent)
+    flush(b);
+}
+
+struct frame_handler {
+  bot& b;
+  uint64_t now;
+
+  void operator()(message::tag<message::_hello>, const message::frame_header_t&, uint32_t& caps)
+  {
+    b.extended = (caps & message::caps::extended_header) != 0;
+  }
+
+  void operator()(message::tag<message::_join>, const message::frame_header_t&, uint32_t&)
+  {
+    b.joined = true;
+  }
+
+  void operator()(message::tag<message::_spectate>, const message::frame_header_t&, uint32_t&)
+  {
+    b.joined = true;
+  }
+
+  void operator()(message::tag<message::_ping>, const message::frame_header_t&, message::sync_t& ping)
+  {
+    send_frame(b, message::header<message::_pong>(tetris::side_t::none), message::next_t{message::sync_t{ping.origin, now, now}});
+    flush(b);
+  }
+
+  void operator()(message::tag<message::_side>, const message::frame_header_t& header, std::monostate&)
+  {
+    b.side = header.side;
+    start_playing(b, now);
+    flush(b);
+  }
+
+  template <message::type_t T, typename V>
+  void operator()(message::tag<T>, const message::frame_header_t&, V&)
+  {
+  }
+};
+
+// false if the stream is corrupt
+static bool handle_frames(bot& b, uint64_t now)
+{
+  static uint8_t scratch[message::max_frame_size];
+
+  message::frame_t frame;
+  message::parse_result result;
+  while ((result = message::parse(b.recv, frame, scratch)) == message::parse_result::frame) {
+    const message::frame_header_t& header = frame.header;
+    if (header.type < message::_last) {
+      totals.frames_recv[header.type]++;
+      if (header.extended)
+        totals.latency[header.type].record(now - header.time);
+    }
+    if (b.joined || header.type == message::_join || header.type == message::_spectate
+        || header.type == message::_hello || header.type == message::_ping)
+      message::dispatch(header, frame.next, frame_handler{b, now});
+    b.recv.consume(frame.size);
+  }
+  if (result == message::parse_result::error) {
+    std::cerr << "fd " << b.fd << " bad frame length " << frame.header.next_length << '\n';
+    return false;
+  }
+  return true;
+}
+
+// false once the connection is gone
+static bool shm_recv(bot& b)
+{
+  uint8_t bells[64];
+  while (1) {
+    ssize_t len = ::recv(b.fd, bells, (sizeof (bells)), MSG_DONTWAIT);
+    if (len < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        break;
+      std::cerr << "recv: " << b.fd << ": " << std::strerror(errno) << '\n';
+      return false;
+    } else if (len == 0)
+      return false;
+    if (static_cast<std::size_t>(len) < (sizeof (bells)))
+      break; // a short read took them all
+  }
+
+  while (1) {
+    const std::size_t len = b.shm->read(b.recv.write_ptr(), b.recv.write_len());
+    if (len == 0) {
+      if (b.shm->sleep())
+        break;
+      continue;
+    }
+    b.recv.commit(len);
+    totals.bytes_recv += len;
+    if (!handle_frames(b, message::monotonic_ns()))
+      return false;
+  }
+
+  // the doorbell may also mean the server made room for what is unsent
+  if (b.shm->wake())
+    shm::ring_doorbell(b.fd);
+  flush(b);
+  return true;
+}
+
+// false once the connection is gone
+static bool handle_recv(bot& b)
+{
+  if (b.shm)
+    return shm_recv(b);
+
+  while (1) {
+    ssize_t len = ::recv(b.fd, b.recv.write_ptr(), b.recv.write_len(), MSG_DONTWAIT);
+    if (len < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return true;
+      std::cerr << "recv: " << b.fd << ": " << std::strerror(errno) << '\n';
+      return false;
+    } else if (len == 0)
+      return false;
+    b.recv.commit(len);
+    totals.bytes_recv += len;
+    // frames stamped after the wakeup arrive in later reads
+    if (!handle_frames(b, message::monotonic_ns()))
+      return false;
+  }
+}
+
+// resource usage of a process, from /proc
+struct usage {
+  uint64_t cpu_ticks = 0; // utime + stime
+  uint64_t rss_kb = 0;
+};
+
+static usage sample(int pid)
+{
+  usage u;
+  std::ifstream stat("/proc/" + std::to_string(pid) + "/stat");
+  std::string line;
+  if (std::getline(stat, line)) {
+    // the fields after the parenthesized command name; utime and stime are 14 and 15
+    std::istringstream fields(line.substr(line.rfind(')') + 2));
+    std::string field;
+    uint64_t utime = 0, stime = 0;
+    for (int i = 3; i <= 15 && fields >> field; i++) {
+      if (i == 14) utime = std::stoull(field);
+      if (i == 15) stime = std::stoull(field);
+    }
+    u.cpu_ticks = utime + stime;
+  }
+  std::ifstream status("/proc/" + std::to_string(pid) + "/status");
+  while (std::getline(status, line)) {
+    if (line.rfind("VmRSS:", 0) == 0)
+      u.rss_kb = std::stoull(line.substr(6));
+  }
+  return u;
+}
+
+static const char * const type_names[message::_last] = {
+  "field", "side", "next_piece", "move", "drop", "attack", "input", "hello", "join", "spectate",
+  "ping", "pong", "correct",
+};
+
+static void report(std::ostream& os, double elapsed, int players, int spectators,
+                   const usage& server_start, const usage& server_end, const usage& self_end)
+{
+  uint64_t frames_recv = 0;
+  for (uint64_t n : totals.frames_recv)
+    frames_recv += n;
+
+  const int matches = players / 2;
+  os << "clients " << players + spectators << " players " << players << " spectators " << spectators << '\n'
+     << "matches " << matches << '\n'
+     << "elapsed_s " << elapsed << '\n'
+     << "frames_sent " << totals.frames_sent << " per_s " << totals.frames_sent / elapsed << '\n'
+     << "bytes_sent " << totals.bytes_sent << '\n'
+     << "send_stalls " << totals.send_stalls << '\n'
+     << "frames_recv " << frames_recv << " per_s " << frames_recv / elapsed << '\n'
+     << "bytes_recv " << totals.bytes_recv << '\n'
+     << "disconnects " << totals.disconnects << '\n';
+  for (int i = 0; i < message::_last; i++) {
+    if (totals.frames_recv[i] == 0)
+      continue;
+    os << "frames_recv_" << type_names[i] << ' ' << totals.frames_recv[i] << '\n';
+    std::string name = std::string("latency_") + type_names[i] + "_ns";
+    if (totals.latency[i].total.load() != 0)
+      totals.latency[i].dump(os, name.c_str());
+  }
+
+  const double hz = static_cast<double>(sysconf(_SC_CLK_TCK));
+  if (opt.pid != 0) {
+    const double server_cores = (server_end.cpu_ticks - server_start.cpu_ticks) / hz / elapsed;
+    os << "server_cpu_percent " << 100.0 * server_cores << '\n'
+       << "server_rss_kb " << server_end.rss_kb << '\n';
+    // assumes the server's cost grows linearly with matches
+    if (server_cores > 0)
+      os << "matches_per_core " << matches / server_cores << '\n';
+  }
+  os << "loadgen_cpu_percent " << 100.0 * self_end.cpu_ticks / hz / elapsed << '\n'
+     << "loadgen_rss_kb " << self_end.rss_kb << '\n';
+}
+
+static int run()
+{
+  // thousands of connections need more than the default descriptor limit
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+
+  struct addrinfo hints{};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  struct addrinfo * addr = nullptr;
+  if (opt.shm_path == nullptr && !local_path(opt.host)) {
+    int ret = getaddrinfo(opt.host, opt.port, &hints, &addr);
+    if (ret != 0) {
+      std::cerr << "getaddrinfo: " << gai_strerror(ret) << '\n';
+      return 1;
+    }
+  }
+
+  int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  passert(epoll_fd, "epoll_create1");
+
+  // every room has two players; spectators fill out the rest of it
+  const int room_spectators = opt.spectators >= 1.0 ? 0
+    : static_cast<int>(2.0 * opt.spectators / (1.0 - opt.spectators) + 0.5);
+  const int room_size = 2 + room_spectators;
+
+  std::vector<std::unique_ptr<bot>> bots;
+  for (int i = 0; i < opt.clients; i++) {
+    auto b = std::make_unique<bot>();
+    if (opt.shm_path != nullptr) {
+      b->shm = shm::connect(opt.shm_path, b->fd);
+      if (b->shm == nullptr) {
+        std::cerr << "shm: " << opt.shm_path << ": " << std::strerror(errno) << '\n';
+        return 1;
+      }
+    } else if (addr == nullptr) {
+      b->fd = open_local_connection(opt.host);
+    } else {
+      b->fd = open_connection(addr);
+    }
+    b->room_id = opt.first_room + i / room_size;
+
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    ev.data.u64 = i;
+    passert(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, b->fd, &ev), "epoll_ctl: EPOLL_CTL_ADD");
+
+    if (opt.legacy) {
+      b->joined = true;
+    } else {
+      send_frame(*b, message::header<message::_hello>(tetris::side_t::none), message::next_t{message::caps::extended_header | message::caps::ping | message::caps::join});
+      if (i % room_size < 2)
+        send_frame(*b, message::header<message::_join>(tetris::side_t::none), message::next_t{b->room_id});
+      else
+        send_frame(*b, message::header<message::_spectate>(tetris::side_t::none), message::next_t{b->room_id});
+    }
+    flush(*b);
+    bots.push_back(std::move(b));
+  }
+  if (addr != nullptr)
+    freeaddrinfo(addr);
+  std::cerr << "connected " << opt.clients << " clients\n";
+
+  const usage server_start = opt.pid != 0 ? sample(opt.pid) : usage{};
+  const uint64_t start = message::monotonic_ns();
+  const uint64_t end = start + static_cast<uint64_t>(opt.duration * 1e9);
+
+  std::array<struct epoll_event, 256> events;
+  uint64_t now = start;
+  while (now < end) {
+    int n = epoll_wait(epoll_fd, events.data(), events.size(), 1);
+    if (n < 0 && errno == EINTR)
+      continue;
+    passert(n, "epoll_wait");
+    for (int i = 0; i < n; i++) {
+      bot& b = *bots[events[i].data.u64];
+      if (b.fd < 0)
+        continue;
+      if (events[i].events & EPOLLOUT)
+        flush(b);
+      if ((events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && !handle_recv(b)) {
+        close(b.fd);
+        b.fd = -1;
+        totals.disconnects++;
+      }
+    }
+
+    now = message::monotonic_ns();
+    for (auto& b : bots) {
+      if (b->fd >= 0 && b->joined && b->side != tetris::side_t::none)
+        play(*b, now);
+    }
+  }
+
+  const double elapsed = (message::monotonic_ns() - start) / 1e9;
+  const usage server_end = opt.pid != 0 ? sample(opt.pid) : usage{};
+
+  int players = 0;
+  for (auto& b : bots) {
+    if (b->side != tetris::side_t::none)
+      players++;
+    if (b->fd >= 0)
+      close(b->fd);
+  }
+  report(std::cout, elapsed, players, opt.clients - players, server_start, server_end, sample(getpid()));
+  close(epoll_fd);
+  return 0;
+}
+
+int main(int argc, char * argv[])
+{
+  int c;
+  while ((c = getopt(argc, argv, "a:p:u:c:d:m:D:s:P:Lo:")) != -1) {
+    switch (c) {
+    case 'a': opt.host = optarg; break;
+    case 'p': opt.port = optarg; break;
+    case 'u': opt.shm_path = optarg; break;
+    case 'c': opt.clients = std::atoi(optarg); break;
+    case 'd': opt.duration = std::atof(optarg); break;
+    case 'm': opt.move_rate = std::atof(optarg); break;
+    case 'D': opt.drop_rate = std::atof(optarg); break;
+    case 's': opt.spectators = std::atof(optarg); break;
+    case 'P': opt.pid = std::atoi(optarg); break;
+    case 'L': opt.legacy = true; break;
+    case 'o': opt.first_room = std::strtoul(optarg, nullptr, 10); break;
+    default:
+      std::cerr << "usage: " << argv[0]
+                << " [-a host|path] [-p port] [-u shm socket] [-c clients] [-d seconds]"
+                << " [-m moves/s] [-D drops/s] [-s spectator share] [-P server pid] [-L] [-o first room]\n";
+      return 1;
+    }
+  }
+  if (opt.clients < 1 || opt.duration <= 0 || opt.spectators < 0 || opt.spectators >= 1) {
+    std::cerr << "need at least one client, a positive duration and a spectator share below 1\n";
+    return 1;
+  }
+
+  try {
+    return run();
+  } catch (const char * s) {
+    std::cerr << "loadgen: " << s << '\n';
+  } catch (int) {
+  }
+  return 1;
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// unix domain socket address for path; "@name" is name in the abstract
+// namespace, which leaves nothing on the filesystem. returns the length
+// to pass to bind() or connect()
+inline socklen_t local_address(const char * path, struct sockaddr_un& addr)
+{
+  addr = {};
+  addr.sun_family = AF_UNIX;
+  const std::size_t len = std::min(std::strlen(path), (sizeof (addr.sun_path)) - 1);
+  std::memcpy(addr.sun_path, path, len);
+  if (path[0] == '@') {
+    addr.sun_path[0] = '\0';
+    return offsetof(struct sockaddr_un, sun_path) + len;
+  }
+  return offsetof(struct sockaddr_un, sun_path) + len + 1;
+}
+
+inline bool local_path(const char * s)
+{
+  return s[0] == '/' || s[0] == '@' || s[0] == '.';
+}
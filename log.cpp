@@ -0,0 +1,179 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "log.hpp"
+
+// each thread owns a single-producer ring; the writer thread (or flush())
+// is the only consumer, serialized by registry.mutex
+
+struct record {
+  uint64_t time; // steady clock, nanoseconds
+  uint8_t level;
+  uint8_t category;
+  uint16_t length;
+  uint32_t thread;
+  char text[logging::line_size];
+};
+
+struct log_ring {
+  static constexpr std::size_t capacity = 1024; // power of two
+
+  std::array<record, capacity> records;
+  std::atomic<uint64_t> head{0}; // consumer
+  std::atomic<uint64_t> tail{0}; // producer
+  std::atomic<uint64_t> dropped{0};
+  uint32_t thread;
+};
+
+struct registry_t {
+  std::mutex mutex;
+  std::vector<log_ring *> rings;
+  uint32_t next_thread = 0;
+  std::once_flag writer;
+};
+
+// never destroyed; the writer thread may outlive static destructors
+static registry_t& registry = *new registry_t;
+
+static const char level_names[logging::level_last] = { 'T', 'D', 'I', 'W', 'E' };
+static const char * const category_names[logging::category_last] = { "engine", "server", "net", "client" };
+
+static int _initial_threshold()
+{
+  static const char * const names[logging::level_last] = { "trace", "debug", "info", "warn", "error" };
+  const char * env = std::getenv("TETRIS_LOG");
+  if (env != nullptr) {
+    for (int i = 0; i < logging::level_last; i++) {
+      if (std::strcmp(env, names[i]) == 0)
+        return i;
+    }
+  }
+  return logging::info;
+}
+
+std::atomic<int> logging::threshold{_initial_threshold()};
+
+static uint64_t _now_ns()
+{
+  auto now = std::chrono::steady_clock::now().time_since_epoch();
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(now).count();
+}
+
+// caller holds registry.mutex
+static void _drain()
+{
+  static std::vector<const record *> pending;
+  static std::vector<std::pair<log_ring *, uint64_t>> taken;
+  static std::string out;
+
+  pending.clear();
+  taken.clear();
+  out.clear();
+  for (log_ring * ring : registry.rings) {
+    const uint64_t head = ring->head.load(std::memory_order_relaxed);
+    const uint64_t tail = ring->tail.load(std::memory_order_acquire);
+    for (uint64_t i = head; i < tail; i++)
+      pending.push_back(&ring->records[i & (log_ring::capacity - 1)]);
+    taken.emplace_back(ring, tail);
+
+    const uint64_t dropped = ring->dropped.exchange(0, std::memory_order_relaxed);
+    if (dropped != 0)
+      out += "log: thread " + std::to_string(ring->thread) + " dropped " + std::to_string(dropped) + " lines\n";
+  }
+
+  // threads interleave by the time their lines were written
+  std::stable_sort(pending.begin(), pending.end(),
+                   [](const record * a, const record * b) { return a->time < b->time; });
+  for (const record * r : pending) {
+    char prefix[64];
+    std::snprintf(prefix, (sizeof (prefix)), "%llu.%06llu %c %s %u: ",
+                  (unsigned long long)(r->time / 1'000'000'000),
+                  (unsigned long long)(r->time % 1'000'000'000 / 1000),
+                  level_names[r->level], category_names[r->category], (unsigned)r->thread);
+    out += prefix;
+    out.append(r->text, r->length);
+    out += '\n';
+  }
+
+  for (auto& [ring, tail] : taken)
+    ring->head.store(tail, std::memory_order_release);
+
+  if (!out.empty()) {
+    std::fwrite(out.data(), 1, out.size(), stderr);
+    std::fflush(stderr);
+  }
+}
+
+static void _writer()
+{
+  while (1) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    _drain();
+  }
+}
+
+// the calling thread's ring, registered on first use
+struct ring_owner {
+  log_ring * ring = nullptr;
+
+  log_ring& get()
+  {
+    if (ring == nullptr) {
+      std::call_once(registry.writer, [] {
+        std::thread(_writer).detach();
+        std::atexit(logging::flush);
+      });
+      ring = new log_ring;
+      std::lock_guard<std::mutex> lock(registry.mutex);
+      ring->thread = registry.next_thread++;
+      registry.rings.push_back(ring);
+    }
+    return *ring;
+  }
+
+  ~ring_owner()
+  {
+    if (ring == nullptr)
+      return;
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    _drain();
+    registry.rings.erase(std::find(registry.rings.begin(), registry.rings.end(), ring));
+    delete ring;
+  }
+};
+
+static thread_local ring_owner owner;
+
+logging::line::~line()
+{
+  log_ring& ring = owner.get();
+  const uint64_t tail = ring.tail.load(std::memory_order_relaxed);
+  if (tail - ring.head.load(std::memory_order_acquire) >= log_ring::capacity) {
+    ring.dropped.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  record& r = ring.records[tail & (log_ring::capacity - 1)];
+  r.time = _now_ns();
+  r.level = static_cast<uint8_t>(l);
+  r.category = static_cast<uint8_t>(c);
+  r.length = static_cast<uint16_t>(buf.size());
+  r.thread = ring.thread;
+  std::memcpy(r.text, text, r.length);
+  ring.tail.store(tail + 1, std::memory_order_release);
+}
+
+void logging::flush()
+{
+  std::lock_guard<std::mutex> lock(registry.mutex);
+  _drain();
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <streambuf>
+
+// asynchronous logging. a line is formatted on the calling thread into a
+// fixed buffer and pushed onto that thread's lock-free ring; a background
+// thread drains every ring to stderr, so the caller never waits on the
+// terminal. lines below LOG_LEVEL are compiled out, and lines below the
+// runtime level (TETRIS_LOG=trace|debug|info|warn|error) cost one compare.
+// a full ring drops lines instead of blocking, and says so later
+//
+//   LOG(debug, server, "fd " << fd << " room " << room_id);
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL 1 // debug; per-frame trace lines are not built by default
+#endif
+
+namespace logging {
+  enum level : int { trace, debug, info, warn, error, level_last };
+  enum category : int { engine, server, net, client, category_last };
+
+  constexpr std::size_t line_size = 232; // longer lines are truncated
+
+  extern std::atomic<int> threshold; // runtime minimum level
+
+  inline bool enabled(level l)
+  {
+    return l >= threshold.load(std::memory_order_relaxed);
+  }
+
+  // one line; pushed onto the thread's ring when destroyed
+  class line {
+    struct buffer : std::streambuf {
+      buffer(char * p, std::size_t n) { setp(p, p + n); }
+      std::size_t size() const { return pptr() - pbase(); }
+    };
+
+    level l;
+    category c;
+    char text[line_size];
+    buffer buf;
+    std::ostream os;
+
+  public:
+    line(level l, category c)
+      : l (l)
+      , c (c)
+      , buf (text, line_size)
+      , os (&buf)
+    {
+    }
+
+    line(const line&) = delete;
+    line& operator=(const line&) = delete;
+
+    ~line();
+
+    std::ostream& stream() { return os; }
+  };
+
+  // write out every queued line now, from the calling thread; for paths
+  // that are about to exit
+  void flush();
+}
+
+#define LOG(lvl, cat, ...)                                                    \
+  do {                                                                        \
+    if constexpr (logging::lvl >= LOG_LEVEL) {                                \
+      if (logging::enabled(logging::lvl))                                     \
+        logging::line(logging::lvl, logging::cat).stream() << __VA_ARGS__;    \
+    }                                                                         \
+  } while (0)
@@ -1,7 +1,14 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cstdint>
+#include <utility>
 #include <variant>
 
+#include "bswap.hpp"
+#include "ring.hpp"
 #include "tetris.hpp"
 
 namespace message {
@@ -12,9 +19,46 @@ namespace message {
     _move,
     _drop,
     _attack,
+    _input,
+    _hello,
+    _join,
+    _spectate,
+    _ping,
+    _pong,
+    _correct,
+    _last
   };
 
-  using next_t = std::variant<std::monostate, tetris::field, tetris::piece, std::uint8_t, tetris::attack_t>;
+  // _hello capability bits
+
+  namespace caps {
+    constexpr uint32_t extended_header = (1 << 0);
+    constexpr uint32_t ping = (1 << 1); // answers _ping; the server only pings peers that do
+    constexpr uint32_t join = (1 << 2); // a _join or _spectate follows; no default room meanwhile
+  }
+
+  struct input_t {
+    tetris::event event;
+    uint32_t time; // client clock, milliseconds
+    uint32_t seq; // counts the client's inputs on this connection, from 1
+  };
+
+  // the server's piece for the sender's side once it has applied input seq;
+  // the client rebases its prediction onto it
+  struct correct_t {
+    uint32_t seq;
+    tetris::piece piece;
+  };
+
+  // _ping and _pong timestamps in monotonic_ns(): origin on the pinging
+  // peer's clock, receive and transmit on the answering peer's
+  struct sync_t {
+    uint64_t origin;   // ping sent; the pong echoes it
+    uint64_t receive;  // pong only: ping received
+    uint64_t transmit; // pong only: pong sent
+  };
+
+  using next_t = std::variant<std::monostate, tetris::field, tetris::piece, std::uint8_t, tetris::attack_t, input_t, uint32_t, sync_t, correct_t>;
 
   // frame_header
 
@@ -22,49 +66,362 @@ namespace message {
     type_t type;
     tetris::side_t side;
     uint16_t next_length;
+    // extended header, only sent to peers that negotiated caps::extended_header
+    bool extended = false;
+    uint32_t seq = 0;
+    uint64_t time = 0; // origin monotonic_ns() at send
   };
 
   namespace frame_header {
-    frame_header_t decode(const std::uint8_t * buf);
-    void encode(const frame_header_t& header, std::uint8_t * buf);
+    constexpr uint8_t extended_flag = 0x80; // set in the type byte
 
     constexpr uint16_t size = (sizeof (uint8_t))
                             + (sizeof (uint8_t))
                             + (sizeof (uint16_t));
+
+    constexpr uint16_t extended_size = size
+                                     + (sizeof (uint32_t))  // seq
+                                     + (sizeof (uint64_t)); // time
+
+    // the header length implied by the type byte at buf[0]
+    inline uint16_t size_of(const std::uint8_t * buf)
+    {
+      return (buf[0] & extended_flag) ? extended_size : size;
+    }
+
+    inline uint16_t size_of(const frame_header_t& header)
+    {
+      return header.extended ? extended_size : size;
+    }
+
+    inline frame_header_t decode(const std::uint8_t * buf)
+    {
+      const uint8_t type = *((uint8_t *)(buf + 0));
+      frame_header_t header = {
+        static_cast<message::type_t>(type & ~extended_flag),
+        static_cast<tetris::side_t>(*((uint8_t *)(buf + 1))),
+        bswap::ntoh(*((uint16_t *)(buf + 2))), // next_length
+      };
+      if (type & extended_flag) {
+        header.extended = true;
+        header.seq = bswap::ntoh(*((uint32_t *)(buf + 4)));
+        header.time = bswap::ntoh(*((uint64_t *)(buf + 8)));
+      }
+      return header;
+    }
+
+    inline void encode(const frame_header_t& header, std::uint8_t * buf)
+    {
+      *((uint8_t *)(buf + 0)) = header.type | (header.extended ? extended_flag : 0);
+      *((uint8_t *)(buf + 1)) = static_cast<uint8_t>(header.side);
+      *((uint16_t *)(buf + 2)) = bswap::hton(header.next_length);
+      if (header.extended) {
+        *((uint32_t *)(buf + 4)) = bswap::hton(header.seq);
+        *((uint64_t *)(buf + 8)) = bswap::hton(header.time);
+      }
+    }
   }
 
-  // field
+  // payload codecs; every payload has a fixed size
+
+  struct empty {
+    using value_type = std::monostate;
+
+    static constexpr uint16_t size = 0;
+
+    static void decode(const std::uint8_t *, value_type&) {}
+    static void encode(const value_type&, std::uint8_t *) {}
+  };
+
+  struct field {
+    using value_type = tetris::field;
+
+    static constexpr uint16_t size = (sizeof (uint8_t)) * tetris::rows * tetris::columns;
+
+    static inline int cell_index(int u, int v)
+    {
+      return (v * tetris::columns + u);
+    }
+
+    static void decode(const std::uint8_t * buf, tetris::field& field)
+    {
+      for (int u = 0; u < tetris::columns; u++) {
+        for (int v = 0; v < tetris::rows; v++) {
+          field[u][v].color = static_cast<tetris::tet>(buf[cell_index(u, v)]);
+        }
+      }
+    }
+
+    static void encode(const tetris::field& field, std::uint8_t * buf)
+    {
+      for (int u = 0; u < tetris::columns; u++) {
+        for (int v = 0; v < tetris::rows; v++) {
+          buf[cell_index(u, v)] = static_cast<uint8_t>(field[u][v].color);
+        }
+      }
+    }
+  };
+
+  struct piece {
+    using value_type = tetris::piece;
+
+    static constexpr uint16_t size = (sizeof (uint8_t))     // tet
+                                   + (sizeof (uint8_t))     // facing
+                                   + (sizeof (int8_t)) * 2 // pos
+                                   + (sizeof (int8_t));    // drop_row
+
+    static void decode(const std::uint8_t * buf, tetris::piece& piece)
+    {
+      piece.tet = static_cast<tetris::tet>(buf[0]);
+      piece.facing = static_cast<tetris::dir>(buf[1]);
+      piece.pos.u = ((std::int8_t*)buf)[2];
+      piece.pos.v = ((std::int8_t*)buf)[3];
+      piece.drop_row = ((std::int8_t*)buf)[4];
+    }
+
+    static void encode(const tetris::piece& piece, std::uint8_t * buf)
+    {
+      buf[0] = static_cast<uint8_t>(piece.tet);
+      buf[1] = static_cast<uint8_t>(piece.facing);
+      ((std::int8_t*)buf)[2] = piece.pos.u;
+      ((std::int8_t*)buf)[3] = piece.pos.v;
+      ((std::int8_t*)buf)[4] = piece.drop_row;
+    }
+  };
+
+  struct attack {
+    using value_type = tetris::attack_t;
+
+    static constexpr uint16_t size = (sizeof (uint8_t))   // rows
+                                   + (sizeof (uint8_t));  // column
+
+    static void decode(const std::uint8_t * buf, tetris::attack_t& attack)
+    {
+      attack.rows = buf[0];
+      attack.column = buf[1];
+    }
+
+    static void encode(const tetris::attack_t& attack, std::uint8_t * buf)
+    {
+      buf[0] = attack.rows;
+      buf[1] = attack.column;
+    }
+  };
+
+  struct input {
+    using value_type = input_t;
+
+    static constexpr uint16_t size = (sizeof (uint8_t))   // event
+                                   + (sizeof (uint32_t))  // time
+                                   + (sizeof (uint32_t)); // seq
+
+    static void decode(const std::uint8_t * buf, input_t& input)
+    {
+      input.event = static_cast<tetris::event>(buf[0]);
+      input.time = bswap::ntoh(*((uint32_t *)(buf + 1)));
+      input.seq = bswap::ntoh(*((uint32_t *)(buf + 5)));
+    }
 
-  namespace field {
-    void decode(const std::uint8_t * buf, tetris::field& field);
-    void encode(const tetris::field& field, std::uint8_t * buf);
+    static void encode(const input_t& input, std::uint8_t * buf)
+    {
+      buf[0] = static_cast<uint8_t>(input.event);
+      *((uint32_t *)(buf + 1)) = bswap::hton(input.time);
+      *((uint32_t *)(buf + 5)) = bswap::hton(input.seq);
+    }
+  };
+
+  struct correct {
+    using value_type = correct_t;
+
+    static constexpr uint16_t size = (sizeof (uint32_t)) // seq
+                                   + piece::size;
+
+    static void decode(const std::uint8_t * buf, correct_t& correct)
+    {
+      correct.seq = bswap::ntoh(*((uint32_t *)(buf + 0)));
+      piece::decode(buf + 4, correct.piece);
+    }
+
+    static void encode(const correct_t& correct, std::uint8_t * buf)
+    {
+      *((uint32_t *)(buf + 0)) = bswap::hton(correct.seq);
+      piece::encode(correct.piece, buf + 4);
+    }
+  };
+
+  struct hello {
+    using value_type = uint32_t;
+
+    static constexpr uint16_t size = (sizeof (uint32_t)); // caps
+
+    static void decode(const std::uint8_t * buf, uint32_t& caps)
+    {
+      caps = bswap::ntoh(*((uint32_t *)(buf + 0)));
+    }
+
+    static void encode(const uint32_t& caps, std::uint8_t * buf)
+    {
+      *((uint32_t *)(buf + 0)) = bswap::hton(caps);
+    }
+  };
+
+  struct join {
+    using value_type = uint32_t;
+
+    static constexpr uint16_t size = (sizeof (uint32_t)); // room id
+
+    static void decode(const std::uint8_t * buf, uint32_t& room)
+    {
+      room = bswap::ntoh(*((uint32_t *)(buf + 0)));
+    }
+
+    static void encode(const uint32_t& room, std::uint8_t * buf)
+    {
+      *((uint32_t *)(buf + 0)) = bswap::hton(room);
+    }
+  };
+
+  struct sync {
+    using value_type = sync_t;
+
+    static constexpr uint16_t size = (sizeof (uint64_t))  // origin
+                                   + (sizeof (uint64_t))  // receive
+                                   + (sizeof (uint64_t)); // transmit
+
+    static void decode(const std::uint8_t * buf, sync_t& sync)
+    {
+      sync.origin = bswap::ntoh(*((uint64_t *)(buf + 0)));
+      sync.receive = bswap::ntoh(*((uint64_t *)(buf + 8)));
+      sync.transmit = bswap::ntoh(*((uint64_t *)(buf + 16)));
+    }
 
-    constexpr uint16_t size = (sizeof (uint8_t)) * tetris::rows * tetris::columns;
+    static void encode(const sync_t& sync, std::uint8_t * buf)
+    {
+      *((uint64_t *)(buf + 0)) = bswap::hton(sync.origin);
+      *((uint64_t *)(buf + 8)) = bswap::hton(sync.receive);
+      *((uint64_t *)(buf + 16)) = bswap::hton(sync.transmit);
+    }
+  };
+
+  // schema: the payload codec of each message type; this is the only place
+  // a type is bound to its layout
+
+  template <type_t T> struct schema;
+  template <> struct schema<_field>      : field {};
+  template <> struct schema<_side>       : empty {};
+  template <> struct schema<_next_piece> : piece {};
+  template <> struct schema<_move>       : piece {};
+  template <> struct schema<_drop>       : piece {};
+  template <> struct schema<_attack>     : attack {};
+  template <> struct schema<_input>      : input {};
+  template <> struct schema<_hello>      : hello {};
+  template <> struct schema<_join>       : join {};
+  template <> struct schema<_spectate>   : join {};
+  template <> struct schema<_ping>       : sync {};
+  template <> struct schema<_pong>       : sync {};
+  template <> struct schema<_correct>    : correct {};
+
+  template <type_t T>
+  using tag = std::integral_constant<type_t, T>;
+
+  template <type_t T>
+  inline frame_header_t header(tetris::side_t side)
+  {
+    return {T, side, schema<T>::size};
   }
 
-  // piece
+  template <type_t T>
+  inline size_t encode(const frame_header_t& header, const typename schema<T>::value_type& value, std::uint8_t * buf)
+  {
+    const uint16_t header_size = frame_header::size_of(header);
+    frame_header_t h = header;
+    h.type = T;
+    h.next_length = schema<T>::size;
+    frame_header::encode(h, buf);
+    schema<T>::encode(value, buf + header_size);
+    return header_size + schema<T>::size;
+  }
+
+  namespace detail {
+    template <type_t T>
+    size_t encode_next(const frame_header_t& header, const next_t& next, std::uint8_t * buf)
+    {
+      return encode<T>(header, std::get<typename schema<T>::value_type>(next), buf);
+    }
+
+    using encode_fn = size_t (*)(const frame_header_t&, const next_t&, std::uint8_t *);
+
+    template <std::size_t... I>
+    constexpr std::array<encode_fn, sizeof...(I)> make_encoders(std::index_sequence<I...>)
+    {
+      return {{ &encode_next<static_cast<type_t>(I)>... }};
+    }
 
-  namespace piece {
-    void decode(const std::uint8_t * buf, tetris::piece& piece);
-    void encode(const tetris::piece& piece, std::uint8_t * buf);
+    constexpr auto encoders = make_encoders(std::make_index_sequence<_last>{});
 
-    constexpr uint16_t size = (sizeof (uint8_t))     // tet
-                            + (sizeof (uint8_t))     // facing
-                            + (sizeof (int8_t)) * 2 // pos
-                            + (sizeof (int8_t));    // drop_row
+    template <type_t T, typename Handler>
+    inline bool dispatch_one(const frame_header_t& header, const std::uint8_t * buf, Handler& handler)
+    {
+      if (header.next_length != schema<T>::size)
+        return false;
+      typename schema<T>::value_type value{};
+      schema<T>::decode(buf, value);
+      handler(tag<T>{}, header, value);
+      return true;
+    }
+
+    template <typename Handler, std::size_t... I>
+    inline bool dispatch(const frame_header_t& header, const std::uint8_t * buf, Handler& handler, std::index_sequence<I...>)
+    {
+      bool handled = false;
+      ((header.type == I && (handled = dispatch_one<static_cast<type_t>(I)>(header, buf, handler), true)) || ...);
+      return handled;
+    }
   }
 
-  // attack
+  // encode a queued frame; header.type selects the codec, and must have one
+  inline size_t encode(const frame_header_t& header, const next_t& next, std::uint8_t * buf)
+  {
+    assert(static_cast<std::size_t>(header.type) < detail::encoders.size());
+    return detail::encoders[header.type](header, next, buf);
+  }
 
-  namespace attack {
-    void decode(const std::uint8_t * buf, tetris::attack_t& attack);
-    void encode(const tetris::attack_t& attack, std::uint8_t * buf);
+  // decode the payload at buf and call handler(tag<T>{}, header, value);
+  // false if the type is unknown or next_length disagrees with the schema
+  template <typename Handler>
+  inline bool dispatch(const frame_header_t& header, const std::uint8_t * buf, Handler&& handler)
+  {
+    return detail::dispatch(header, buf, handler, std::make_index_sequence<_last>{});
+  }
 
-    constexpr uint16_t size = (sizeof (uint8_t))   // rows
-                            + (sizeof (uint8_t));  // column
+  // stream parsing
+
+  namespace detail {
+    template <std::size_t... I>
+    constexpr uint16_t max_size(std::index_sequence<I...>)
+    {
+      return std::max({ schema<static_cast<type_t>(I)>::size... });
+    }
   }
 
-  //
+  constexpr uint16_t max_next_length = detail::max_size(std::make_index_sequence<_last>{});
+  constexpr uint16_t max_frame_size = frame_header::extended_size + max_next_length;
+
+  struct frame_t {
+    frame_header_t header;
+    const std::uint8_t * next; // points into the ring, or into scratch if the frame wraps
+    uint16_t size;             // header and next, as consumed from the ring
+  };
+
+  enum class parse_result {
+    frame,
+    partial,
+    error,
+  };
+
+  // parse the frame at the read position of ring without consuming it;
+  // scratch must hold max_frame_size bytes
+  parse_result parse(const ring_buffer& ring, frame_t& frame, std::uint8_t * scratch);
 
-  size_t encode(const frame_header_t& header, const next_t& next, std::uint8_t * buf);
+  uint64_t monotonic_ns();
 }
@@ -0,0 +1,80 @@
+#include <cerrno>
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <thread>
+
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "log.hpp"
+#include "metrics.hpp"
+#include "stats.hpp"
+
+static void serve(int listen_fd)
+{
+  while (1) {
+    int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno != EINTR)
+        LOG(warn, server, "metrics: accept4: " << std::strerror(errno));
+      continue;
+    }
+
+    // any request gets the dump; a scraper that never sends is cut off
+    struct timeval timeout = { .tv_sec = 1, .tv_usec = 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, (sizeof (timeout)));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, (sizeof (timeout)));
+    char request[1024];
+    (void)recv(fd, request, (sizeof (request)), 0);
+
+    std::ostringstream body;
+    stats::dump(body);
+    std::string s = body.str();
+    std::ostringstream response;
+    response << "HTTP/1.0 200 OK\r\n"
+             << "Content-Type: text/plain\r\n"
+             << "Content-Length: " << s.size() << "\r\n"
+             << "\r\n"
+             << s;
+    std::string r = response.str();
+    std::size_t sent = 0;
+    while (sent < r.size()) {
+      ssize_t len = send(fd, r.data() + sent, r.size() - sent, MSG_NOSIGNAL);
+      if (len <= 0)
+        break;
+      sent += len;
+    }
+    close(fd);
+  }
+}
+
+bool metrics::start(uint16_t port)
+{
+  int fd = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    LOG(error, server, "metrics: socket: " << std::strerror(errno));
+    return false;
+  }
+
+  int opt = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, (sizeof (int)));
+
+  // loopback only; the counters are not for the outside world
+  struct sockaddr_in sockaddr = {};
+  sockaddr.sin_family = AF_INET;
+  sockaddr.sin_port = htons(port);
+  sockaddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  if (::bind(fd, (struct sockaddr *)&sockaddr, (sizeof (sockaddr))) < 0
+      || ::listen(fd, 16) < 0) {
+    LOG(error, server, "metrics: " << port << ": " << std::strerror(errno));
+    close(fd);
+    return false;
+  }
+
+  LOG(info, server, "metrics on 127.0.0.1:" << port);
+  std::thread(serve, fd).detach();
+  return true;
+}
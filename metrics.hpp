@@ -0,0 +1,11 @@
+#pragma once
+
+#include <cstdint>
+
+// plain-text HTTP scrape of stats::dump on 127.0.0.1:port, served by a
+// thread of its own so a slow scraper never stalls a worker
+
+namespace metrics {
+  // false if the port could not be opened
+  bool start(uint16_t port);
+}
@@ -0,0 +1,61 @@
+#include <bit>
+#include <cassert>
+#include <cstdlib>
+#include <new>
+
+#include "pool.hpp"
+
+constexpr std::size_t slab_size = 1 << 20;
+constexpr int min_shift = std::countr_zero(pool::min_size);
+constexpr int class_count = std::countr_zero(pool::max_size) - min_shift + 1;
+
+struct free_chunk {
+  free_chunk * next;
+};
+
+// trivially destructible, so static destructors that run after the
+// thread's thread_locals are torn down can still free into them
+static thread_local free_chunk * free_lists[class_count];
+static thread_local std::size_t _reserved;
+
+static inline int size_class(std::size_t size)
+{
+  assert(std::has_single_bit(size) && size >= pool::min_size && size <= pool::max_size);
+  return std::countr_zero(size) - min_shift;
+}
+
+static void refill(int c, std::size_t size)
+{
+  uint8_t * slab = static_cast<uint8_t *>(std::malloc(slab_size));
+  if (slab == nullptr)
+    throw std::bad_alloc();
+  _reserved += slab_size;
+  for (std::size_t offset = 0; offset < slab_size; offset += size) {
+    free_chunk * chunk = reinterpret_cast<free_chunk *>(slab + offset);
+    chunk->next = free_lists[c];
+    free_lists[c] = chunk;
+  }
+}
+
+uint8_t * pool::alloc(std::size_t size)
+{
+  int c = size_class(size);
+  if (free_lists[c] == nullptr)
+    refill(c, size);
+  free_chunk * chunk = free_lists[c];
+  free_lists[c] = chunk->next;
+  return reinterpret_cast<uint8_t *>(chunk);
+}
+
+void pool::free(uint8_t * p, std::size_t size)
+{
+  int c = size_class(size);
+  free_chunk * chunk = reinterpret_cast<free_chunk *>(p);
+  chunk->next = free_lists[c];
+  free_lists[c] = chunk;
+}
+
+std::size_t pool::reserved()
+{
+  return _reserved;
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// per-thread slab allocator for I/O buffers: power-of-two chunks from
+// min_size to max_size, carved from 1 MiB slabs and kept on free lists.
+// a chunk must be freed on the thread that allocated it
+
+namespace pool {
+  constexpr std::size_t min_size = 256;
+  constexpr std::size_t max_size = 65536;
+
+  // size must be a power of two in [min_size, max_size]
+  uint8_t * alloc(std::size_t size);
+  void free(uint8_t * chunk, std::size_t size);
+
+  // bytes carved into slabs by the calling thread
+  std::size_t reserved();
+}
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include "pool.hpp"
+
+// byte ring with free-running head and tail counters that are masked on
+// access, so capacity must be a power of two. storage comes from the
+// thread's pool and may be absent (capacity 0) until reserve()
+
+struct ring_buffer
+{
+  uint8_t * buf;
+  std::size_t capacity;
+  std::size_t head; // read position
+  std::size_t tail; // write position
+
+  ring_buffer()
+    : buf (nullptr)
+    , capacity (0)
+    , head (0)
+    , tail (0)
+  {
+  }
+
+  ring_buffer(std::size_t capacity)
+    : ring_buffer()
+  {
+    reserve(capacity);
+  }
+
+  ring_buffer(const ring_buffer&) = delete;
+  ring_buffer& operator=(const ring_buffer&) = delete;
+
+  ~ring_buffer()
+  {
+    if (buf != nullptr)
+      pool::free(buf, capacity);
+  }
+
+  std::size_t size() const { return tail - head; }
+  std::size_t space() const { return capacity - size(); }
+  bool empty() const { return head == tail; }
+  void clear() { head = tail = 0; }
+
+  // contiguous free bytes at the write position
+  uint8_t * write_ptr() { return buf + (tail & (capacity - 1)); }
+  std::size_t write_len() const
+  {
+    return std::min(space(), capacity - (tail & (capacity - 1)));
+  }
+  void commit(std::size_t n) { tail += n; }
+
+  // contiguous readable bytes at the read position
+  const uint8_t * read_ptr() const { return buf + (head & (capacity - 1)); }
+  std::size_t read_len() const
+  {
+    return std::min(size(), capacity - (head & (capacity - 1)));
+  }
+  void consume(std::size_t n)
+  {
+    head += n;
+    if (head == tail)
+      clear(); // an empty ring restarts at offset 0, so the next write is contiguous
+  }
+
+  // copy n readable bytes to out, joining the two halves of a wrapped range
+  void peek(uint8_t * out, std::size_t n) const
+  {
+    if (n == 0)
+      return;
+    std::size_t first = std::min(n, read_len());
+    std::memcpy(out, read_ptr(), first);
+    std::memcpy(out + first, buf, n - first);
+  }
+
+  // copy n bytes in at the write position, splitting them across the end
+  void write(const uint8_t * in, std::size_t n)
+  {
+    if (n == 0)
+      return;
+    std::size_t first = std::min(n, write_len());
+    std::memcpy(write_ptr(), in, first);
+    std::memcpy(buf, in + first, n - first);
+    commit(n);
+  }
+
+  // grow to hold at least n bytes, keeping the contents
+  void reserve(std::size_t n)
+  {
+    if (n <= capacity)
+      return;
+    std::size_t c = std::max(capacity, pool::min_size);
+    while (c < n)
+      c *= 2;
+    uint8_t * b = pool::alloc(c);
+    std::size_t len = size();
+    peek(b, len);
+    if (buf != nullptr)
+      pool::free(buf, capacity);
+    buf = b;
+    capacity = c;
+    head = 0;
+    tail = len;
+  }
+
+  // give the storage back to the pool while there is nothing in it
+  void release()
+  {
+    if (buf != nullptr && empty()) {
+      pool::free(buf, capacity);
+      buf = nullptr;
+      capacity = 0;
+      clear();
+    }
+  }
+};
@@ -3,36 +3,153 @@
 #include <cstring>
 #include <iostream>
 #include <memory>
-#include <queue>
+#include <deque>
+#include <algorithm>
 #include <unordered_map>
 #include <unordered_set>
 #include <chrono>
+#include <condition_variable>
+#include <mutex>
 #include <random>
+#include <csignal>
+#include <cstdlib>
+#include <vector>
 
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include "bswap.hpp"
+#include "local_socket.hpp"
+#include "log.hpp"
 #include "message.hpp"
+#include "metrics.hpp"
 #include "server.hpp"
+#include "snapshot.hpp"
+#include "stats.hpp"
+#include "uring.hpp"
 
-static int _epoll_fd;
-static std::unordered_set<tetris::side_t> sides;
+// every worker has its own event loop, clients and rooms; nothing below is
+// shared except through worker::inbox
 
-static std::unordered_map<int, poll_action> clients;
+static std::vector<std::unique_ptr<worker>> workers;
+static thread_local worker * self;
+
+enum class backend { epoll, uring };
+static backend io_backend = backend::epoll;
+
+static thread_local int _epoll_fd;
+static thread_local uring * _ring;
+static thread_local uring_buffers * _buffers;
+static thread_local std::vector<int> dirty; // fds to flush at the end of an event batch
+static thread_local std::vector<int> backlog; // fds with frames left over from their turn
+
+static thread_local timing_wheel * _wheel;
+static thread_local int _timer_fd;
+static thread_local bool _timer_armed; // the timerfd only ticks while the wheel is non-empty
+
+// -r: hold broadcasts and flush each room this often; 0 sends them with
+// the event batch that caused them
+static uint64_t broadcast_interval_ns = 0;
+
+// -v: how often spectators get the room
+static uint64_t spectator_interval_ns = 100'000'000;
+
+// -f, -B: frames and bytes per second each client may send; 0 for no limit
+static double frame_rate = 1000;
+static double byte_rate = 256 * 1024;
+
+// -I: how long a client may send nothing before it is closed and its side
+// freed; 0 keeps idle clients forever
+static uint64_t idle_timeout_ns = 30'000'000'000;
+
+// -u: unix socket for the same protocol as the TCP port
+static const char * unix_path = nullptr;
+
+// -s: unix socket where same-host clients are given a shared-memory channel
+static const char * shm_path = nullptr;
+
+// -S: room snapshots, taken on SIGUSR2, on SIGTERM and every -i seconds,
+// and restored at startup
+static const char * snapshot_path = nullptr;
+static uint64_t snapshot_interval_ns = 0;
+static std::vector<snapshot::room_t> restored; // read before the workers start
+
+static thread_local client_table clients;
+static thread_local std::unordered_map<uint32_t, room> rooms;
+
+// trace of the frame being handled; broadcasts caused by it carry it along
+static thread_local message::frame_header_t origin_trace;
+static thread_local uint32_t server_seq = 0;
 
 //
 
 static void passert(int ret, const char* s)
 {
   if (ret < 0) {
-    std::cerr << s << ": " << std::strerror(errno) << '\n';
+    LOG(error, net, s << ": " << std::strerror(errno));
     throw ret;
   }
 }
 
+// timers
+
+static inline uint64_t current_tick()
+{
+  return message::monotonic_ns() / tick_ns;
+}
+
+static void arm_timer(bool on)
+{
+  struct itimerspec spec = {};
+  if (on) {
+    spec.it_interval.tv_nsec = tick_ns;
+    spec.it_value.tv_nsec = tick_ns;
+  }
+  int ret = timerfd_settime(_timer_fd, 0, &spec, NULL);
+  stats::local.counters.syscalls++;
+  passert(ret, "timerfd_settime");
+  _timer_armed = on;
+}
+
+static int open_timer()
+{
+  int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  passert(fd, "timerfd_create");
+  return fd;
+}
+
+// run t->fn about ns from now, on the next tick at or after it
+static void schedule(timer& t, uint64_t ns)
+{
+  if (_wheel->count == 0)
+    _wheel->now = current_tick(); // nothing advanced the wheel while it was idle
+  _wheel->schedule(t, (ns + tick_ns - 1) / tick_ns);
+  if (!_timer_armed)
+    arm_timer(true);
+}
+
+static void handle_tick()
+{
+  uint64_t expirations;
+  ssize_t ret = read(_timer_fd, &expirations, (sizeof (expirations)));
+  stats::local.counters.syscalls++;
+  if (ret < 0 && errno != EAGAIN)
+    passert(ret, "read: timer_fd");
+
+  // expired timers run in one batch; a late tick catches up in the same pass
+  _wheel->advance(current_tick());
+  if (_wheel->count == 0 && _timer_armed)
+    arm_timer(false);
+}
+
 static int open_port(uint16_t port)
 {
   int ret;
@@ -46,6 +163,20 @@ static int open_port(uint16_t port)
   ret = ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, (sizeof (int)));
   passert(ret, "setsockopt: SO_REUSEADDR");
 
+  // every worker listens on the same port; the kernel spreads accepts
+  ret = ::setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, (sizeof (int)));
+  passert(ret, "setsockopt: SO_REUSEPORT");
+
+  // accepted sockets inherit keepalive, which finds the half-open
+  // connections of clients we do not ping
+  if (idle_timeout_ns != 0) {
+    ret = ::setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &opt, (sizeof (int)));
+    passert(ret, "setsockopt: SO_KEEPALIVE");
+    int idle = static_cast<int>(std::min<uint64_t>(idle_timeout_ns / 1'000'000'000, 32767));
+    ret = ::setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, (sizeof (int)));
+    passert(ret, "setsockopt: TCP_KEEPIDLE");
+  }
+
   struct sockaddr_in6 sockaddr = {
     .sin6_family = AF_INET6,
     .sin6_port = htons(port),
@@ -62,7 +193,34 @@ static int open_port(uint16_t port)
   ret = ::getsockname(fd, (struct sockaddr *)&sockaddr, &socklen);
   passert(ret, "getsockname");
 
-  std::cerr << "listening on port: " << ntohs(sockaddr.sin6_port) << '\n';
+  LOG(info, server, "listening on port: " << ntohs(sockaddr.sin6_port));
+
+  return fd;
+}
+
+// only the first worker listens on a unix socket; there is no SO_REUSEPORT
+// spreading, and accepted clients move to their room's owner anyway
+static int open_local(const char * path)
+{
+  int ret;
+  int fd;
+
+  ret = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  passert(ret, "socket");
+  fd = ret;
+
+  struct sockaddr_un sockaddr;
+  socklen_t socklen = local_address(path, sockaddr);
+  if (path[0] != '@')
+    ::unlink(path); // left behind by an earlier run
+
+  ret = ::bind(fd, (struct sockaddr *)&sockaddr, socklen);
+  passert(ret, "bind");
+
+  ret = ::listen(fd, 1024);
+  passert(ret, "listen");
+
+  LOG(info, server, "listening on: " << path);
 
   return fd;
 }
@@ -75,162 +233,612 @@ static void _epoll_add(const int fd, uint32_t events)
   };
 
   int ret = epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+  stats::local.counters.syscalls++;
   passert(ret, "epoll_ctl: EPOLL_CTL_ADD");
 }
 
-static void _epoll_mod(const int fd, uint32_t events)
+static void _epoll_del(const int fd)
 {
-  struct epoll_event ev = {
-    .events = EPOLLIN | events | EPOLLONESHOT,
-    .data = { .fd=fd }
-  };
-  int ret = epoll_ctl(_epoll_fd, EPOLL_CTL_MOD, fd, &ev);
-  passert(ret, "epoll_ctl: EPOLL_CTL_MOD");
+  int ret = epoll_ctl(_epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+  stats::local.counters.syscalls++;
+  passert(ret, "epoll_ctl: EPOLL_CTL_DEL");
 }
 
-static bool handle_send(poll_action& action)
+// coalesce every queued frame that fits behind the unsent bytes, so that
+// a burst of frames costs a single send
+static void fill_send(poll_action& action)
 {
-  if (action.queue.empty())
-    std::cerr << "handle_send " << action.fd << " while action.queue is empty\n";
-
-  while (!action.queue.empty() || action.send.buf_ix) {
-    uint16_t buf_len;
-    if (action.send.buf_ix) {
-      buf_len = action.send.buf_ix;
+  while (!action.queue.empty()) {
+    auto& [header, next] = action.queue.front();
+    header.extended = action.extended;
+    const std::size_t frame_size = message::frame_header::size_of(header) + header.next_length;
+    if (action.send.space() < frame_size) {
+      if (action.send.size() + frame_size > buf_size)
+        break;
+      action.send.reserve(std::max(action.send.size() + frame_size, initial_buf_size));
+    }
+    if (header.extended)
+      stats::local.latency.broadcast.record(message::monotonic_ns() - header.time);
+    if (action.send.write_len() >= frame_size) {
+      message::encode(header, next, action.send.write_ptr());
+      action.send.commit(frame_size);
     } else {
-      auto [header, next] = action.queue.front();
-      buf_len = message::encode(header, next, action.send.buf);
+      // the frame straddles the end of the ring
+      uint8_t frame[message::max_frame_size];
+      message::encode(header, next, frame);
+      action.send.write(frame, frame_size);
     }
-    ssize_t len = send(action.fd, action.send.buf, buf_len, 0);
+    stats::local.counters.frames_sent_by_type[header.type]++;
+    action.queue.pop();
+    stats::local.counters.frames_sent++;
+  }
+  if (action.queue.bytes <= queue_limit && action.behind_since != 0) {
+    action.behind_since = 0;
+    _wheel->cancel(action.behind_timer);
+  }
+}
+
+static inline bool send_pending(const poll_action& action)
+{
+  return !action.queue.empty() || !action.send.empty();
+}
+
+// shared-memory clients: frames go through the channel's rings, and the
+// socket only carries doorbells
+
+static void shm_wake(poll_action& action)
+{
+  if (action.shm->wake()) {
+    shm::ring_doorbell(action.fd);
+    stats::local.counters.doorbells++;
+    stats::local.counters.syscalls++;
+  }
+}
+
+static void shm_send(poll_action& action)
+{
+  while (send_pending(action)) {
+    fill_send(action);
+
+    const std::size_t first = action.send.read_len();
+    std::size_t len = action.shm->write(action.send.read_ptr(), first);
+    if (len == first)
+      len += action.shm->write(action.send.buf, action.send.size() - first);
+    stats::local.counters.bytes_sent += len;
+    action.send.consume(len);
+
+    // the client rings once it has made room
+    if (!action.send.empty() && action.shm->block())
+      break;
+  }
+  action.send.release();
+  shm_wake(action);
+}
+
+static bool handle_send(poll_action& action)
+{
+  if (action.shm) {
+    shm_send(action);
+    return false; // keep
+  }
+
+  while (send_pending(action)) {
+    fill_send(action);
+
+    // unsent bytes that wrapped around the ring go out in the same call
+    struct iovec iov[2];
+    const std::size_t first = action.send.read_len();
+    iov[0].iov_base = const_cast<uint8_t *>(action.send.read_ptr());
+    iov[0].iov_len = first;
+    iov[1].iov_base = action.send.buf;
+    iov[1].iov_len = action.send.size() - first;
+    struct msghdr msg = {};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iov[1].iov_len > 0 ? 2 : 1;
+
+    ssize_t len = sendmsg(action.fd, &msg, MSG_NOSIGNAL);
+    stats::local.counters.send_calls++;
+    stats::local.counters.syscalls++;
     if (len < 0) {
-      if (errno == EAGAIN || errno == EWOULDBLOCK)
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        action.writable = false; // the next EPOLLOUT edge resumes
         return false; // keep
+      }
       else {
-        std::cerr << "recv: " << action.fd << ": " << std::strerror(errno) << '\n';
+        LOG(warn, net, "send: " << action.fd << ": " << std::strerror(errno));
         return true; // remove
       }
     } else if (len == 0)
       return true; // remove
 
-    if (!action.send.buf_ix)
-      action.queue.pop();
+    stats::local.counters.bytes_sent += len;
 
-    action.send.buf_ix = buf_len - len;
-    if (len < buf_len) {
-      std::cerr << "send memmove: " << action.send.buf_ix << '\n';
-      memmove(action.send.buf, action.send.buf + len, action.send.buf_ix);
-    }
+    // a partial send only consumes what was sent; the ring goes back to the pool once drained
+    action.send.consume(len);
+    action.send.release();
   }
 
   return false; // keep
 }
 
+static void mark_dirty(poll_action& action)
+{
+  if (!action.dirty) {
+    action.dirty = true;
+    dirty.push_back(action.fd);
+  }
+}
+
+static void evict(poll_action& action)
+{
+  LOG(warn, server, "fd " << action.fd << " evicted: " << action.queue.bytes << " bytes queued");
+  action.evicting = true;
+  stats::local.counters.evictions++;
+  mark_dirty(action);
+}
+
+static void behind_expired(timer& t)
+{
+  poll_action& action = *static_cast<poll_action *>(t.data);
+  if (action.behind_since != 0 && !action.evicting)
+    evict(action);
+}
+
+// a client over queue_limit is behind. one that stays behind past the
+// grace period, or reaches the hard limit, is disconnected rather than
+// allowed to grow its queue; nothing but superseded moves is ever dropped
+static void check_behind(poll_action& action)
+{
+  if (action.behind_since == 0) {
+    action.behind_since = message::monotonic_ns();
+    action.behind_timer.fn = behind_expired;
+    action.behind_timer.data = &action;
+    schedule(action.behind_timer, queue_grace_ns);
+  }
+  if (action.queue.bytes > queue_hard_limit)
+    evict(action);
+}
+
+// carry the trace of the frame being handled, or start a new one
+static void stamp(message::frame_header_t& header)
+{
+  if (origin_trace.extended) {
+    header.seq = origin_trace.seq;
+    header.time = origin_trace.time;
+  } else {
+    header.seq = ++server_seq;
+    header.time = message::monotonic_ns();
+  }
+}
+
+static void enqueue(poll_action& action, message::frame_header_t& header, message::next_t&& next)
+{
+  if (action.evicting)
+    return;
+
+  stamp(header);
+
+  if (action.queue.push(std::pair{header, std::move(next)})) {
+    stats::local.counters.moves_coalesced++;
+    return;
+  }
+  mark_dirty(action);
+  if (action.queue.bytes > queue_limit)
+    check_behind(action);
+}
+
 namespace queue_send {
   static void field(poll_action& action, tetris::side_t field_side, tetris::field& field)
   {
-    message::frame_header_t header;
-    header.type = message::type_t::_field;
-    header.side = field_side;
-    header.next_length = message::field::size;
+    message::frame_header_t header = message::header<message::_field>(field_side);
 
-    action.queue.push(std::pair{header, message::next_t{field}});
-    _epoll_mod(action.fd, EPOLLOUT);
+    enqueue(action, header, message::next_t{field});
   }
 
   static void move(poll_action& action, tetris::side_t piece_side, tetris::piece& piece)
   {
-    message::frame_header_t header;
-    header.type = message::type_t::_move;
-    header.side = piece_side;
-    header.next_length = message::piece::size;
+    message::frame_header_t header = message::header<message::_move>(piece_side);
 
-    action.queue.push(std::pair{header, message::next_t{piece}});
-    _epoll_mod(action.fd, EPOLLOUT);
+    enqueue(action, header, message::next_t{piece});
   }
 
   static void next_piece(poll_action& action, tetris::side_t piece_side, tetris::piece& piece)
   {
-    std::cerr << "_next_piece\n";
-    message::frame_header_t header;
-    header.type = message::type_t::_next_piece;
-    header.side = piece_side;
-    header.next_length = message::piece::size;
+    LOG(trace, server, "_next_piece");
+    message::frame_header_t header = message::header<message::_next_piece>(piece_side);
 
-    action.queue.push(std::pair{header, message::next_t{piece}});
-    _epoll_mod(action.fd, EPOLLOUT);
+    enqueue(action, header, message::next_t{piece});
   }
 
   static void drop(poll_action& action, tetris::side_t piece_side, tetris::piece& piece)
   {
-    message::frame_header_t header;
-    header.type = message::type_t::_drop;
-    header.side = piece_side;
-    header.next_length = message::piece::size;
+    message::frame_header_t header = message::header<message::_drop>(piece_side);
+
+    enqueue(action, header, message::next_t{piece});
+  }
+
+  static void correct(poll_action& action, tetris::piece& piece)
+  {
+    message::frame_header_t header = message::header<message::_correct>(action.side);
 
-    action.queue.push(std::pair{header, message::next_t{piece}});
-    _epoll_mod(action.fd, EPOLLOUT);
+    enqueue(action, header, message::next_t{message::correct_t{action.input_seq, piece}});
+  }
+
+  static void hello(poll_action& action, uint32_t caps)
+  {
+    message::frame_header_t header = message::header<message::_hello>(action.side);
+
+    enqueue(action, header, message::next_t{caps});
   }
 
   static void attack(poll_action& action, tetris::side_t piece_side, tetris::attack_t& attack)
   {
-    message::frame_header_t header;
-    header.type = message::type_t::_attack;
-    header.side = piece_side;
-    header.next_length = message::attack::size;
+    message::frame_header_t header = message::header<message::_attack>(piece_side);
+
+    enqueue(action, header, message::next_t{attack});
+  }
+
+  static void join(poll_action& action, uint32_t room_id)
+  {
+    message::frame_header_t header = message::header<message::_join>(action.side);
+
+    enqueue(action, header, message::next_t{room_id});
+  }
+
+  static void spectate(poll_action& action, uint32_t room_id)
+  {
+    message::frame_header_t header = message::header<message::_spectate>(action.side);
+
+    enqueue(action, header, message::next_t{room_id});
+  }
+
+  static void ping(poll_action& action)
+  {
+    message::frame_header_t header = message::header<message::_ping>(action.side);
 
-    action.queue.push(std::pair{header, message::next_t{attack}});
-    _epoll_mod(action.fd, EPOLLOUT);
+    enqueue(action, header, message::next_t{message::sync_t{message::monotonic_ns(), 0, 0}});
   }
+
+  static void pong(poll_action& action, const message::sync_t& pong)
+  {
+    message::frame_header_t header = message::header<message::_pong>(action.side);
+
+    enqueue(action, header, message::next_t{pong});
+  }
+}
+
+// clients that negotiated caps::ping get a _ping every ping_interval_ns;
+// their _pong replies keep action.clock current
+
+static void ping_expired(timer& t)
+{
+  poll_action& action = *static_cast<poll_action *>(t.data);
+  if (action.evicting)
+    return;
+  queue_send::ping(action);
+  schedule(action.ping_timer, ping_interval_ns);
+}
+
+static void start_pinging(poll_action& action)
+{
+  action.ping_timer.fn = ping_expired;
+  action.ping_timer.data = &action;
+  ping_expired(action.ping_timer);
+}
+
+// idle clients: a half-open connection never sends again, so a client that
+// is silent for idle_timeout_ns is closed, which frees its side. the _pong
+// replies to our pings are its heartbeat, so only clients that negotiated
+// caps::ping are watched; a baseline client may rightly stay silent for
+// good, and TCP keepalive finds it gone instead. receiving only stores the
+// time; idle_timer fires once per timeout and is pushed back by however
+// long the client has been active since, so a busy client costs no timer
+// updates
+
+static void idle_expired(timer& t)
+{
+  poll_action& action = *static_cast<poll_action *>(t.data);
+  const uint64_t idle = message::monotonic_ns() - action.active;
+  if (idle < idle_timeout_ns) {
+    schedule(action.idle_timer, idle_timeout_ns - idle);
+    return;
+  }
+  if (action.evicting)
+    return;
+  LOG(info, server, "fd " << action.fd << " idle for " << idle / 1'000'000 << " ms, closing");
+  action.evicting = true;
+  stats::local.counters.idle_closed++;
+  mark_dirty(action);
+}
+
+static void watch_idle(poll_action& action)
+{
+  if (idle_timeout_ns == 0)
+    return;
+  action.idle_timer.fn = idle_expired;
+  action.idle_timer.data = &action;
+  schedule(action.idle_timer, idle_timeout_ns - std::min(idle_timeout_ns, message::monotonic_ns() - action.active));
+}
+
+// timed flushes: with -r a room holds what it would broadcast and flushes
+// it to every subscriber once per broadcast interval; spectators always
+// get the room this way, at the spectator interval
+
+static void schedule_flush(room& room, held_frames& held);
+
+static void flush_room(timer& t)
+{
+  room& room = *static_cast<struct room *>(t.data);
+  const uint64_t start = message::monotonic_ns();
+
+  // frames in the order they were broadcast
+  for (auto& [origin, header, next] : room.held.frames) {
+    origin_trace = header;
+    origin_trace.extended = true;
+    for (poll_action * client : room.subscribers) {
+      if (origin != tetris::side_t::none && client->side == origin)
+        continue;
+      message::frame_header_t h = header;
+      enqueue(*client, h, message::next_t{next});
+    }
+  }
+  room.held.frames.clear();
+
+  // then where every piece that moved is now
+  for (int i = 0; i < tetris::frame_count; i++) {
+    if (!room.held.moves[i])
+      continue;
+    origin_trace = *room.held.moves[i];
+    origin_trace.extended = true;
+    room.held.moves[i].reset();
+    const tetris::side_t side = static_cast<tetris::side_t>(i);
+    for (poll_action * client : room.subscribers) {
+      if (client->side == side)
+        continue;
+      queue_send::move(*client, side, room.frames[i].piece);
+    }
+  }
+  origin_trace = {};
+  stats::local.load.room_flush.record(message::monotonic_ns() - start);
+}
+
+// frames encoded once and copied to every spectator that takes them
+struct shared_frames
+{
+  std::vector<uint8_t> bytes;
+  std::array<uint32_t, message::_last> by_type;
+  uint32_t count;
+
+  void clear()
+  {
+    bytes.clear();
+    by_type.fill(0);
+    count = 0;
+  }
+
+  void add(message::frame_header_t header, const message::next_t& next, bool extended)
+  {
+    header.extended = extended;
+    const std::size_t at = bytes.size();
+    bytes.resize(at + message::frame_header::size_of(header) + header.next_length);
+    message::encode(header, next, bytes.data() + at);
+    by_type[header.type]++;
+    count++;
+  }
+};
+
+// copy shared frames behind whatever the spectator has pending; false if
+// they do not fit, and the spectator takes a keyframe later instead
+static bool send_shared(poll_action& action, const shared_frames& frames)
+{
+  // frames sent to it alone, such as the _spectate reply, go first. the
+  // ring may not move under an in-flight io_uring send
+  if (!action.sending)
+    fill_send(action);
+  if (!action.queue.empty())
+    return false;
+  const std::size_t n = frames.bytes.size();
+  if (action.send.space() < n) {
+    if (action.sending || action.send.size() + n > buf_size)
+      return false;
+    action.send.reserve(std::max(action.send.size() + n, initial_buf_size));
+  }
+  action.send.write(frames.bytes.data(), n);
+  stats::local.counters.frames_sent += frames.count;
+  for (int i = 0; i < message::_last; i++)
+    stats::local.counters.frames_sent_by_type[i] += frames.by_type[i];
+  mark_dirty(action);
+  return true;
+}
+
+// one delta (everything held since the last flush) and, for spectators
+// that need one, one keyframe (every side's field and piece), each
+// encoded once per header format
+static void flush_spectators(timer& t)
+{
+  room& room = *static_cast<struct room *>(t.data);
+  const uint64_t start = message::monotonic_ns();
+  static thread_local std::array<shared_frames, 2> delta; // by extended
+  static thread_local std::array<shared_frames, 2> keyframe;
+
+  // encode only the formats some spectator takes this interval
+  std::array<bool, 2> wants_delta = {};
+  std::array<bool, 2> wants_keyframe = {};
+  for (const poll_action * spectator : room.spectators) {
+    if (spectator->evicting)
+      continue;
+    if (spectator->keyframe)
+      wants_keyframe[spectator->extended] = true;
+    else
+      wants_delta[spectator->extended] = true;
+  }
+
+  for (int extended = 0; extended < 2; extended++) {
+    delta[extended].clear();
+    if (wants_delta[extended]) {
+      for (auto& [origin, header, next] : room.watched.frames)
+        delta[extended].add(header, next, extended);
+      for (int i = 0; i < tetris::frame_count; i++) {
+        if (!room.watched.moves[i])
+          continue;
+        message::frame_header_t header = *room.watched.moves[i];
+        delta[extended].add(header, message::next_t{room.frames[i].piece}, extended);
+      }
+    }
+
+    keyframe[extended].clear();
+    if (wants_keyframe[extended]) {
+      for (int i = 0; i < tetris::frame_count; i++) {
+        const tetris::side_t side = static_cast<tetris::side_t>(i);
+        message::frame_header_t field = message::header<message::_field>(side);
+        stamp(field);
+        keyframe[extended].add(field, message::next_t{room.frames[i].field}, extended);
+        message::frame_header_t move = message::header<message::_move>(side);
+        stamp(move);
+        keyframe[extended].add(move, message::next_t{room.frames[i].piece}, extended);
+      }
+    }
+  }
+  room.watched.frames.clear();
+  for (auto& move : room.watched.moves)
+    move.reset();
+
+  bool behind = false;
+  for (poll_action * spectator : room.spectators) {
+    if (spectator->evicting)
+      continue;
+    // the keyframe is the current state, so it already covers the delta
+    if (spectator->keyframe) {
+      spectator->keyframe = !send_shared(*spectator, keyframe[spectator->extended]);
+    } else if (!delta[spectator->extended].bytes.empty()) {
+      if (!send_shared(*spectator, delta[spectator->extended])) {
+        spectator->keyframe = true;
+        stats::local.counters.spectator_resyncs++;
+      }
+    }
+    behind |= spectator->keyframe;
+  }
+  // a spectator still owed a keyframe gets another try next interval
+  if (behind)
+    schedule_flush(room, room.watched);
+  stats::local.load.room_flush.record(message::monotonic_ns() - start);
+}
+
+static void schedule_flush(room& room, held_frames& held)
+{
+  if (held.flush_timer.scheduled())
+    return;
+  const bool spectators = &held == &room.watched;
+  held.flush_timer.fn = spectators ? flush_spectators : flush_room;
+  held.flush_timer.data = &room;
+  schedule(held.flush_timer, spectators ? spectator_interval_ns : broadcast_interval_ns);
+}
+
+// origin none goes to every subscriber
+static void hold(room& room, held_frames& held, tetris::side_t origin, message::frame_header_t header, const message::next_t& next)
+{
+  stamp(header);
+  held.frames.emplace_back(origin, header, next);
+  schedule_flush(room, held);
+}
+
+// only the latest position is sent, read from room.frames at the flush
+static void hold_move(room& room, held_frames& held, tetris::side_t origin)
+{
+  message::frame_header_t header = message::header<message::_move>(origin);
+  stamp(header);
+  held.moves[(int)origin] = header;
+  schedule_flush(room, held);
 }
 
+// players pay for spectators with one held frame per broadcast, however
+// many of them there are
 namespace broadcast {
-  static void field(tetris::side_t origin)
+  static void field(room& room, tetris::side_t origin)
   {
-    for (auto& client : clients) {
-      if (client.second.side == origin || client.second.type == poll_action::accept)
+    const message::frame_header_t header = message::header<message::_field>(origin);
+    if (!room.spectators.empty())
+      hold(room, room.watched, origin, header, message::next_t{room.frames[(int)origin].field});
+    if (broadcast_interval_ns != 0) {
+      hold(room, room.held, origin, header, message::next_t{room.frames[(int)origin].field});
+      return;
+    }
+    for (poll_action * client : room.subscribers) {
+      if (client->side == origin)
         continue;
-      std::cerr << "broadcast field " << (int)origin << " to fd " << client.second.fd << '\n';
-      queue_send::field(client.second, origin, tetris::frames[(int)origin].field);
+      LOG(trace, server, "broadcast field " << (int)origin << " to fd " << client->fd);
+      queue_send::field(*client, origin, room.frames[(int)origin].field);
     }
   }
 
-  static void move(tetris::side_t origin)
+  static void move(room& room, tetris::side_t origin)
   {
-    for (auto& client : clients) {
-      if (client.second.side == origin || client.second.type == poll_action::accept)
+    if (!room.spectators.empty())
+      hold_move(room, room.watched, origin);
+    if (broadcast_interval_ns != 0) {
+      hold_move(room, room.held, origin);
+      return;
+    }
+    for (poll_action * client : room.subscribers) {
+      if (client->side == origin)
         continue;
-      queue_send::move(client.second, origin, tetris::frames[(int)origin].piece);
+      queue_send::move(*client, origin, room.frames[(int)origin].piece);
     }
   }
 
-  static void next_piece(tetris::side_t origin)
+  static void next_piece(room& room, tetris::side_t origin)
   {
-    for (auto& client : clients) {
-      if (client.second.side == origin || client.second.type == poll_action::accept)
+    const message::frame_header_t header = message::header<message::_next_piece>(origin);
+    if (!room.spectators.empty()) {
+      room.watched.moves[(int)origin].reset(); // the move was of the previous piece
+      hold(room, room.watched, origin, header, message::next_t{room.frames[(int)origin].piece});
+    }
+    if (broadcast_interval_ns != 0) {
+      room.held.moves[(int)origin].reset();
+      hold(room, room.held, origin, header, message::next_t{room.frames[(int)origin].piece});
+      return;
+    }
+    for (poll_action * client : room.subscribers) {
+      if (client->side == origin)
         continue;
-      std::cerr << "broadcast next_piece " << (int)origin << " to fd " << client.second.fd << '\n';
-      queue_send::next_piece(client.second, origin, tetris::frames[(int)origin].piece);
+      LOG(trace, server, "broadcast next_piece " << (int)origin << " to fd " << client->fd);
+      queue_send::next_piece(*client, origin, room.frames[(int)origin].piece);
     }
   }
 
-  static void drop(tetris::side_t origin)
+  static void drop(room& room, tetris::side_t origin)
   {
-    for (auto& client : clients) {
-      if (client.second.side == origin || client.second.type == poll_action::accept)
+    const message::frame_header_t header = message::header<message::_drop>(origin);
+    if (!room.spectators.empty()) {
+      room.watched.moves[(int)origin].reset(); // the drop carries the final position
+      hold(room, room.watched, origin, header, message::next_t{room.frames[(int)origin].piece});
+    }
+    if (broadcast_interval_ns != 0) {
+      room.held.moves[(int)origin].reset();
+      hold(room, room.held, origin, header, message::next_t{room.frames[(int)origin].piece});
+      return;
+    }
+    for (poll_action * client : room.subscribers) {
+      if (client->side == origin)
         continue;
-      std::cerr << "broadcast drop " << (int)origin << " to fd " << client.second.fd << '\n';
-      queue_send::drop(client.second, origin, tetris::frames[(int)origin].piece);
+      LOG(trace, server, "broadcast drop " << (int)origin << " to fd " << client->fd);
+      queue_send::drop(*client, origin, room.frames[(int)origin].piece);
     }
   }
 
-  static void attack(tetris::side_t dest, tetris::attack_t& attack)
+  static void attack(room& room, tetris::side_t dest, tetris::attack_t& attack)
   {
-    for (auto& client : clients) {
+    const message::frame_header_t header = message::header<message::_attack>(dest);
+    if (!room.spectators.empty())
+      hold(room, room.watched, tetris::side_t::none, header, message::next_t{attack});
+    if (broadcast_interval_ns != 0) {
+      hold(room, room.held, tetris::side_t::none, header, message::next_t{attack});
+      return;
+    }
+    for (poll_action * client : room.subscribers) {
       // there is no origin; garbage is server-initiated
-      if (client.second.type == poll_action::accept)
-        continue;
-      std::cerr << "broadcast attack " << (int)dest << " to fd " << client.second.fd << '\n';
-      queue_send::attack(client.second, dest, attack);
+      LOG(trace, server, "broadcast attack " << (int)dest << " to fd " << client->fd);
+      queue_send::attack(*client, dest, attack);
     }
   }
 }
@@ -241,7 +849,7 @@ namespace dump {
     for (int i = 0; i < tetris::frame_count; i++) {
       if (static_cast<int>(action.side) == i)
         continue;
-      queue_send::field(action, static_cast<tetris::side_t>(i), tetris::frames[i].field);
+      queue_send::field(action, static_cast<tetris::side_t>(i), action.room->frames[i].field);
     }
   }
 
@@ -250,203 +858,1563 @@ namespace dump {
     for (int i = 0; i < tetris::frame_count; i++) {
       if (static_cast<int>(action.side) == i)
         continue;
-      queue_send::move(action, static_cast<tetris::side_t>(i), tetris::frames[i].piece);
+      queue_send::move(action, static_cast<tetris::side_t>(i), action.room->frames[i].piece);
     }
   }
 }
 
-static auto seed = std::chrono::system_clock::now().time_since_epoch().count();
-static std::default_random_engine generator (seed);
-std::uniform_int_distribution<int> column_distribution(0, (int)tetris::columns - 1);
-
-static size_t handle_recv_frame(poll_action& action, uint8_t *bufi, size_t len)
+static void allocate_side(poll_action& action)
 {
-  if (len < message::frame_header::size)
-    return 0;
+  room& room = *action.room;
+  if (!room.sides.empty()) {
+    action.side = *room.sides.begin();
+    LOG(debug, server, "fd " << action.fd << " side " << static_cast<int>(action.side));
+    room.sides.erase(room.sides.begin());
 
-  message::frame_header_t header = message::frame_header::decode(bufi);
-  bufi += message::frame_header::size;
+    // a side kept across a restart: its player continues from the saved
+    // field and piece, which arrive before the _side
+    const int i = static_cast<int>(action.side);
+    if (room.resume[i]) {
+      room.resume[i] = false;
+      queue_send::field(action, action.side, room.frames[i].field);
+      queue_send::move(action, action.side, room.frames[i].piece);
+    }
 
-  if (len < header.next_length) {
-    return 0;
-  }
+    message::frame_header_t header = message::header<message::_side>(action.side);
+    enqueue(action, header, message::next_t{});
+  } else
+    LOG(debug, server, "no sides remain");
+}
 
-  assert(static_cast<int>(header.side) < tetris::frame_count);
-  switch (header.type) {
-  case message::type_t::_field:
-    assert(header.next_length == message::field::size);
-    message::field::decode(bufi, tetris::frames[(int)header.side].field);
-    broadcast::field(header.side);
-    break;
-  case message::type_t::_move:
-    assert(header.next_length == message::piece::size);
-    message::piece::decode(bufi, tetris::frames[(int)header.side].piece);
-    broadcast::move(header.side);
-    break;
-  case message::type_t::_next_piece:
-    message::piece::decode(bufi, tetris::frames[(int)header.side].piece);
-    tetris::_garbage(tetris::frames[(int)header.side].field, tetris::frames[(int)header.side].garbage);
-    broadcast::next_piece(header.side);
-    break;
-  case message::type_t::_drop:
-  {
-    assert(header.next_length == message::piece::size);
-    message::piece::decode(bufi, tetris::frames[(int)header.side].piece);
-    int cleared = tetris::place(tetris::frames[(int)header.side]);
-    broadcast::drop(header.side);
-    if (cleared > 0) {
-      tetris::attack_t attack;
-      attack.rows = cleared;
-      attack.column = column_distribution(generator);
-
-      std::cerr << "garbage created by " << (int)header.side << '\n';
-      tetris::side_t next_side = (tetris::side_t)(((int)header.side + 1) % (tetris::frame_count - sides.size()));
-      if (next_side != header.side) {
-        tetris::attack(tetris::frames[(int)next_side], attack);
-        broadcast::attack(next_side, attack);
-      } else
-        std::cerr << "garbage not sent\n";
-    }
-    break;
-  }
-  default:
-    std::cerr << "unhandled frame type " << header.type << '\n';
-    break;
+static void join_room(poll_action& action, uint32_t room_id)
+{
+  auto [room_it, _] = rooms.try_emplace(room_id, room_id);
+  action.room = &room_it->second;
+
+  if (action.spectator) {
+    // caught up by a keyframe at the next spectator flush
+    action.room->spectators.push_back(&action);
+    action.keyframe = true;
+    schedule_flush(*action.room, action.room->watched);
+    LOG(debug, server, "fd " << action.fd << " room " << room_id << " spectator");
+    return;
   }
 
-  return message::frame_header::size + header.next_length;
+  action.room->subscribers.push_back(&action);
+
+  // send _side message
+  allocate_side(action);
+  LOG(debug, server, "fd " << action.fd << " room " << room_id << " side " << static_cast<int>(action.side));
+  dump::fields(action);
+  dump::moves(action);
 }
 
-static bool handle_recv(poll_action& action)
+static void leave_room(poll_action& action)
 {
-  while (true) {
-    ssize_t len = recv(action.fd, action.recv.buf + action.recv.buf_ix, buf_size - action.recv.buf_ix, 0);
-    if (len < 0) {
-      if (errno == EAGAIN || errno == EWOULDBLOCK)
-        return false; // keep
-      else {
-        std::cerr << "recv: " << action.fd << ": " << std::strerror(errno) << '\n';
-        return true; // remove
-      }
-    } else if (len == 0)
-      return true; // remove
+  if (action.room == nullptr)
+    return; // not placed yet
+  room& room = *action.room;
+  if (action.side != tetris::side_t::none)
+    room.sides.insert(action.side);
+  action.side = tetris::side_t::none;
+  auto& subscribers = action.spectator ? room.spectators : room.subscribers;
+  auto it = std::find(subscribers.begin(), subscribers.end(), &action);
+  assert(it != subscribers.end());
+  *it = subscribers.back();
+  subscribers.pop_back();
+  action.room = nullptr;
+}
 
-    uint8_t* bufi = action.recv.buf;
-    while (true) {
-      size_t offset = handle_recv_frame(action, bufi, len);
-      if (offset == 0) {
-        break; // bufi does not contain a frame
-      } else {
-        len -= offset;
-        bufi += offset;
-      }
-    }
-    //std::cerr << "recv memmove: " << len << '\n';
-    memmove(action.recv.buf, bufi, len);
-    action.recv.buf_ix = len;
+static void release_room(room * room)
+{
+  if (room == nullptr)
+    return;
+  if (room->subscribers.empty() && room->spectators.empty()) {
+    LOG(debug, server, "room " << room->id << " closed");
+    rooms.erase(room->id);
   }
 }
 
-static void allocate_side(poll_action& action)
+// the worker that owns room_id; every frame of a room is handled on it
+static worker& owner(uint32_t room_id)
 {
-  if (!sides.empty()) {
-    action.side = *sides.begin();
-    std::cerr << "fd " << action.fd << " side " << static_cast<int>(action.side) << '\n';
-    sides.erase(sides.begin());
-    message::frame_header_t header{message::type_t::_side, action.side, 0};
-    action.queue.push(std::pair{header, message::next_t{}});
-  } else
-    std::cerr << "no sides remain\n";
+  return *workers[room_id % workers.size()];
 }
 
-void foo()
+// join room_id here, or mark action to be handed off to the room's owner
+static void enter_room(poll_action& action, uint32_t room_id)
 {
-  _epoll_fd = epoll_create1(EPOLL_CLOEXEC);
-  passert(_epoll_fd, "epoll_create1");
+  if (&owner(room_id) == self) {
+    join_room(action, room_id);
+  } else {
+    action.moving = true;
+    action.moving_room = room_id;
+  }
+}
 
-  auto listen_fd = open_port(5000);
-  auto [it, ok] = clients.try_emplace(listen_fd, listen_fd, poll_action::accept);
-  if (!ok) throw "clients.try_emplace";
-  _epoll_add(listen_fd, EPOLLIN | EPOLLET);
+// a connection takes no room, and so no side, until it asks for one. a
+// client that never does plays in the default room: from its _hello if
+// that announces no _join, from its first frame of play, or after
+// join_grace_ns. until then it stays on the worker that accepted it
 
-  std::array<struct epoll_event, 16> events;
+static bool placed(const poll_action& action)
+{
+  return action.room != nullptr || action.moving;
+}
 
-  while (1) {
-    const int ready_count = epoll_wait(_epoll_fd, events.data(), events.size(), -1);
-    if (ready_count < 0 && errno == EINTR)
-      continue;
-    passert(ready_count, "epoll_wait");
+static void place_default(poll_action& action)
+{
+  LOG(debug, server, "fd " << action.fd << " default room");
+  enter_room(action, default_room);
+  mark_dirty(action); // a move to another worker happens at the flush
+}
+
+static void join_expired(timer& t)
+{
+  poll_action& action = *static_cast<poll_action *>(t.data);
+  if (!placed(action) && !action.evicting && !action.closing)
+    place_default(action);
+}
+
+static void await_join(poll_action& action)
+{
+  action.join_timer.fn = join_expired;
+  action.join_timer.data = &action;
+  schedule(action.join_timer, join_grace_ns);
+}
+
+static thread_local auto seed = std::chrono::system_clock::now().time_since_epoch().count();
+static thread_local std::default_random_engine generator (seed);
+static thread_local std::uniform_int_distribution<int> column_distribution(0, (int)tetris::columns - 1);
+
+static void place_piece(room& room, tetris::side_t side, int cleared)
+{
+  broadcast::drop(room, side);
+  if (cleared > 0) {
+    tetris::attack_t attack;
+    attack.rows = cleared;
+    attack.column = column_distribution(generator);
+
+    LOG(trace, server, "garbage created by " << (int)side);
+    tetris::side_t next_side = (tetris::side_t)(((int)side + 1) % (tetris::frame_count - room.sides.size()));
+    if (next_side != side) {
+      tetris::attack(room.frames[(int)next_side], attack);
+      broadcast::attack(room, next_side, attack);
+    } else
+      LOG(trace, server, "garbage not sent");
+  }
+}
+
+// a piece with no room to spawn ends the game, and the side starts over.
+// peers apply the garbage they hold for it at the _next_piece, before the
+// new field replaces theirs. the origin gets the field too, in case its
+// prediction did not top out
+static void start_over(poll_action& action)
+{
+  room& room = *action.room;
+  LOG(debug, server, "side " << (int)action.side << " topped out");
+  tetris::reset_frame(room.frames[(int)action.side]);
+  broadcast::next_piece(room, action.side);
+  broadcast::field(room, action.side);
+  queue_send::field(action, action.side, room.frames[(int)action.side].field);
+}
+
+static void simulate_input(poll_action& action, const message::input_t& input)
+{
+  room& room = *action.room;
+  tetris::frame& frame = room.frames[(int)action.side];
+  if (frame.piece.tet == tetris::tet::empty)
+    return; // no _move has established the piece yet
+
+  switch (input.event) {
+  case tetris::event::left:
+    if (tetris::move(frame, {-1, 0}, 0))
+      broadcast::move(room, action.side);
+    break;
+  case tetris::event::right:
+    if (tetris::move(frame, {1, 0}, 0))
+      broadcast::move(room, action.side);
+    break;
+  case tetris::event::down:
+    if (tetris::move(frame, {0, -1}, 0))
+      broadcast::move(room, action.side);
+    break;
+  case tetris::event::drop:
+  {
+    int cleared = tetris::drop(frame);
+    place_piece(room, action.side, cleared);
+    tetris::_garbage(frame.field, frame.garbage);
+    if (tetris::next_piece(frame))
+      broadcast::next_piece(room, action.side);
+    else
+      start_over(action);
+    // the origin predicted its own next piece; the server's bag decides
+    queue_send::correct(action, frame.piece);
+    break;
+  }
+  case tetris::event::spin_cw:
+    if (tetris::move(frame, {0, 0}, 1))
+      broadcast::move(room, action.side);
+    break;
+  case tetris::event::spin_ccw:
+    if (tetris::move(frame, {0, 0}, -1))
+      broadcast::move(room, action.side);
+    break;
+  case tetris::event::spin_180:
+    break;
+  case tetris::event::swap:
+    if (!frame.swapped) {
+      if (tetris::swap(frame))
+        broadcast::move(room, action.side);
+      else
+        start_over(action);
+      queue_send::correct(action, frame.piece);
+    }
+    break;
+  default:
+    LOG(warn, server, "fd " << action.fd << " unhandled input ev " << static_cast<int>(input.event));
+    break;
+  }
+}
+
+struct frame_handler {
+  poll_action& action;
+
+  // derived state is only taken for the sender's own side, and not at all
+  // once it sends _input; the server then simulates the side itself
+  bool trusted(const message::frame_header_t& header)
+  {
+    if (header.side != action.side) {
+      LOG(warn, server, "fd " << action.fd << " rejected frame type " << header.type << " for side " << (int)header.side);
+      return false;
+    }
+    if (action.authoritative)
+      LOG(debug, server, "fd " << action.fd << " ignored frame type " << header.type);
+    return !action.authoritative;
+  }
+
+  // a piece must fit the side's field as the server has it
+  bool fits(const message::frame_header_t& header, const tetris::piece& piece)
+  {
+    if (tetris::fits(action.room->frames[(int)header.side].field, piece))
+      return true;
+    LOG(warn, server, "fd " << action.fd << " rejected frame type " << header.type << ": piece does not fit");
+    return false;
+  }
+
+  void operator()(message::tag<message::_hello>, const message::frame_header_t& header, uint32_t& caps)
+  {
+    caps &= message::caps::extended_header | message::caps::ping | message::caps::join;
+    action.extended = (caps & message::caps::extended_header) != 0;
+    queue_send::hello(action, caps);
+    if ((caps & message::caps::ping) != 0 && !action.pinging) {
+      action.pinging = true;
+      start_pinging(action);
+      watch_idle(action);
+    }
+    if ((caps & message::caps::join) == 0 && !placed(action))
+      place_default(action);
+  }
+
+  void operator()(message::tag<message::_ping>, const message::frame_header_t& header, message::sync_t& ping)
+  {
+    queue_send::pong(action, clock_sync::pong(ping, message::monotonic_ns()));
+  }
+
+  void operator()(message::tag<message::_pong>, const message::frame_header_t& header, message::sync_t& pong)
+  {
+    stats::local.latency.rtt.record(action.clock.add(pong, message::monotonic_ns()));
+  }
+
+  void operator()(message::tag<message::_field>, const message::frame_header_t& header, tetris::field& field)
+  {
+    if (!trusted(header))
+      return;
+    action.room->frames[(int)header.side].field = field;
+    broadcast::field(*action.room, header.side);
+  }
+
+  void operator()(message::tag<message::_move>, const message::frame_header_t& header, tetris::piece& piece)
+  {
+    if (!trusted(header) || !fits(header, piece))
+      return;
+    action.room->frames[(int)header.side].piece = piece;
+    broadcast::move(*action.room, header.side);
+  }
+
+  void operator()(message::tag<message::_next_piece>, const message::frame_header_t& header, tetris::piece& piece)
+  {
+    if (!trusted(header) || !fits(header, piece))
+      return;
+    action.room->frames[(int)header.side].piece = piece;
+    tetris::_garbage(action.room->frames[(int)header.side].field, action.room->frames[(int)header.side].garbage);
+    broadcast::next_piece(*action.room, header.side);
+  }
+
+  void operator()(message::tag<message::_drop>, const message::frame_header_t& header, tetris::piece& piece)
+  {
+    if (!trusted(header) || !fits(header, piece))
+      return;
+    action.room->frames[(int)header.side].piece = piece;
+    int cleared = tetris::place(action.room->frames[(int)header.side]);
+    place_piece(*action.room, header.side, cleared);
+  }
+
+  void operator()(message::tag<message::_input>, const message::frame_header_t& header, message::input_t& input)
+  {
+    if (header.side != action.side || input.event >= tetris::event::last) {
+      LOG(warn, server, "fd " << action.fd << " rejected input for side " << (int)header.side);
+      return;
+    }
+    action.authoritative = true;
+    action.input_seq = input.seq;
+    simulate_input(action, input);
+  }
+
+  void operator()(message::tag<message::_join>, const message::frame_header_t& header, uint32_t& room_id)
+  {
+    room * previous = action.room;
+    leave_room(action);
+    // frames queued before the _join reply belong to the previous room
+    queue_send::join(action, room_id);
+    action.spectator = false;
+    enter_room(action, room_id);
+    release_room(previous);
+  }
+
+  void operator()(message::tag<message::_spectate>, const message::frame_header_t& header, uint32_t& room_id)
+  {
+    room * previous = action.room;
+    leave_room(action);
+    queue_send::spectate(action, room_id);
+    action.spectator = true;
+    enter_room(action, room_id);
+    release_room(previous);
+  }
+
+  template <message::type_t T, typename V>
+  void operator()(message::tag<T>, const message::frame_header_t& header, V&)
+  {
+    LOG(warn, server, "unhandled frame type " << header.type);
+  }
+};
+
+// frames that need no room
+static bool control_frame(message::type_t type)
+{
+  switch (type) {
+  case message::type_t::_hello:
+  case message::type_t::_join:
+  case message::type_t::_spectate:
+  case message::type_t::_ping:
+  case message::type_t::_pong:
+    return true;
+  default:
+    return false;
+  }
+}
+
+static void handle_recv_frame(poll_action& action, const message::frame_t& frame)
+{
+  const message::frame_header_t& header = frame.header;
+
+  // the client's timestamps, placed on our timeline
+  const uint64_t origin_time = action.clock.local(header.time);
+  if (header.extended)
+    stats::local.latency.recv.record(message::monotonic_ns() - origin_time);
+
+  if (!control_frame(header.type)) {
+    if (action.spectator) {
+      LOG(warn, server, "fd " << action.fd << " spectator sent frame type " << header.type);
+      return;
+    }
+    if (static_cast<int>(header.side) >= tetris::frame_count) {
+      LOG(warn, server, "fd " << action.fd << " bad side " << (int)header.side);
+      return;
+    }
+  }
+
+  origin_trace = header;
+  origin_trace.time = origin_time;
+  if (!message::dispatch(header, frame.next, frame_handler{action}))
+    LOG(warn, server, "fd " << action.fd << " bad frame type " << header.type << " length " << header.next_length);
+  origin_trace = {};
+}
+
+// receive fairness: one client's frames never hold up everyone else's.
+// each turn handles at most recv_quantum bytes of a client's frames, and a
+// client with more waits in the backlog, which gets one turn per client
+// after every event batch. with io_uring every turn is taken there, since
+// one batch may hold many completions for the same client. a client past
+// its token buckets waits on throttle_timer instead, with its stream left
+// unread so that the kernel pushes back on the sender
+
+static inline bool held(const poll_action& action)
+{
+  return action.backlogged || action.throttled;
+}
+
+static void defer(poll_action& action)
+{
+  action.backlogged = true;
+  backlog.push_back(action.fd);
+}
+
+static void throttle_expired(timer& t)
+{
+  poll_action& action = *static_cast<poll_action *>(t.data);
+  action.throttled = false;
+  defer(action);
+}
+
+static void uring_cancel(poll_action& action);
+
+// take a frame of size bytes from action's buckets; false if they are
+// short, in which case the frame waits until both have enough
+static bool admit(poll_action& action, std::size_t size, uint64_t now)
+{
+  const bool frames = frame_rate == 0 || action.frame_tokens.level(frame_rate, now) >= 1;
+  const bool bytes = byte_rate == 0 || action.byte_tokens.level(byte_rate, now) >= size;
+  if (frames && bytes) {
+    action.frame_tokens.tokens -= frame_rate == 0 ? 0 : 1;
+    action.byte_tokens.tokens -= byte_rate == 0 ? 0 : size;
+    return true;
+  }
+
+  const uint64_t wait = std::max(frames ? 0 : action.frame_tokens.wait_ns(1, frame_rate),
+                                 bytes ? 0 : action.byte_tokens.wait_ns(size, byte_rate));
+  action.throttled = true;
+  action.throttle_timer.fn = throttle_expired;
+  action.throttle_timer.data = &action;
+  schedule(action.throttle_timer, wait);
+  stats::local.counters.frames_throttled++;
+  LOG(debug, server, "fd " << action.fd << " throttled for " << wait << " ns");
+  // a multishot recv would keep reading the stream meanwhile
+  if (action.receiving && !action.cancelling)
+    uring_cancel(action);
+  return false;
+}
+
+static void append(ring_buffer& ring, const uint8_t * buf, std::size_t n)
+{
+  ring.reserve(ring.size() + n);
+  while (n > 0) {
+    std::size_t len = std::min(n, ring.write_len());
+    std::memcpy(ring.write_ptr(), buf, len);
+    ring.commit(len);
+    buf += len;
+    n -= len;
+  }
+}
+
+// handle complete frames in action.recv, up to budget bytes of them; true
+// if the stream is corrupt. stops early once the connection is held or
+// moving to another worker
+static bool handle_frames(poll_action& action, std::size_t& budget)
+{
+  static thread_local uint8_t scratch[message::max_frame_size];
+  const uint64_t now = message::monotonic_ns();
+  action.active = now;
+
+  while (!action.moving && !held(action)) {
+    message::frame_t frame;
+    message::parse_result result = message::parse(action.recv, frame, scratch);
+    if (result == message::parse_result::partial)
+      break;
+    if (result == message::parse_result::error) {
+      LOG(warn, server, "fd " << action.fd << " bad frame length " << frame.header.next_length);
+      return true; // remove
+    }
+    if (!placed(action) && !control_frame(frame.header.type)) {
+      place_default(action);
+      if (action.moving)
+        break; // the frame goes along to the room's owner
+    }
+    if (budget == 0) {
+      defer(action);
+      break;
+    }
+    if (!admit(action, frame.size, now))
+      break;
+    handle_recv_frame(action, frame);
+    budget -= std::min<std::size_t>(budget, frame.size);
+    action.recv.consume(frame.size);
+    stats::local.counters.frames_recv++;
+    if (frame.header.type < message::_last)
+      stats::local.counters.frames_recv_by_type[frame.header.type]++;
+  }
+  return false;
+}
+
+// handle_frames(), topping action.recv up from action.overflow as it drains
+static bool handle_buffered(poll_action& action, std::size_t& budget)
+{
+  while (1) {
+    if (handle_frames(action, budget))
+      return true;
+    if (action.overflow.empty() || action.moving || held(action))
+      return false;
+    const std::size_t n = std::min(action.overflow.size(), buf_size - action.recv.size());
+    append(action.recv, action.overflow.data(), n);
+    action.overflow.erase(action.overflow.begin(), action.overflow.begin() + n);
+  }
+}
+
+// true if the client is gone
+static bool shm_recv(poll_action& action)
+{
+  // doorbells carry nothing; only the hangup matters. a short read
+  // took them all
+  uint8_t bells[64];
+  while (1) {
+    ssize_t len = recv(action.fd, bells, (sizeof (bells)), MSG_DONTWAIT);
+    stats::local.counters.syscalls++;
+    if (len < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        break;
+      LOG(warn, net, "recv: " << action.fd << ": " << std::strerror(errno));
+      return true; // remove
+    } else if (len == 0)
+      return true; // remove
+    if (static_cast<std::size_t>(len) < (sizeof (bells)))
+      break;
+  }
+
+  // frames left over from the last turn go first; a held client leaves
+  // the rest in the ring, where it blocks the sender once full
+  std::size_t budget = recv_quantum;
+  if (handle_frames(action, budget))
+    return true; // remove
+
+  while (!action.moving && !held(action)) {
+    if (action.recv.capacity == 0)
+      action.recv.reserve(initial_buf_size);
+    const std::size_t offered = action.recv.write_len();
+    const std::size_t len = action.shm->read(action.recv.write_ptr(), offered);
+    if (len == 0) {
+      // a write that raced the check is read now instead of waiting for its doorbell
+      if (action.shm->sleep())
+        break;
+      continue;
+    }
+
+    action.recv.commit(len);
+    stats::local.counters.bytes_recv += len;
+
+    if (handle_frames(action, budget))
+      return true; // remove
+
+    if (len == offered && action.recv.capacity < buf_size)
+      action.recv.reserve(action.recv.capacity * 2);
+  }
+  action.recv.release();
+
+  // the doorbell may also mean the client made room for what is still queued
+  shm_wake(action);
+  if (send_pending(action))
+    mark_dirty(action);
+  return false;
+}
+
+static bool handle_recv(poll_action& action)
+{
+  if (action.shm)
+    return shm_recv(action);
+
+  // frames left over from the last turn go first
+  std::size_t budget = recv_quantum;
+  if (handle_frames(action, budget))
+    return true; // remove
+
+  while (!action.moving && !held(action)) {
+    // a parsed ring never holds more than a partial frame, so there is always room
+    if (action.recv.capacity == 0)
+      action.recv.reserve(initial_buf_size);
+    assert(action.recv.write_len() > 0);
+    const std::size_t offered = action.recv.write_len();
+    ssize_t len = recv(action.fd, action.recv.write_ptr(), offered, 0);
+    stats::local.counters.syscalls++;
+    if (len < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        action.recv.release(); // idle connections hold no buffer
+        return false; // keep
+      }
+      else {
+        LOG(warn, net, "recv: " << action.fd << ": " << std::strerror(errno));
+        return true; // remove
+      }
+    } else if (len == 0)
+      return true; // remove
+
+    action.recv.commit(len);
+    stats::local.counters.bytes_recv += len;
+
+    if (handle_frames(action, budget))
+      return true; // remove
+
+    // a read that filled the ring suggests a pipelined stream; read more at once
+    if (static_cast<std::size_t>(len) == offered && action.recv.capacity < buf_size)
+      action.recv.reserve(action.recv.capacity * 2);
+  }
+  return false; // keep; the rest of the stream is read at the next turn, or by the new owner
+}
+
+// snapshots: the main thread asks every worker for its rooms, each answers
+// from its own event loop, and the main thread writes the file
+
+static struct {
+  std::mutex mutex;
+  std::condition_variable answered;
+  uint64_t generation = 0;
+  std::size_t pending = 0;
+  snapshot::part rooms;
+} snapshots;
+
+static void save_rooms(uint64_t generation)
+{
+  snapshot::part part;
+  for (auto& [id, room] : rooms) {
+    std::array<bool, tetris::frame_count> taken;
+    for (int i = 0; i < tetris::frame_count; i++)
+      taken[i] = room.resume[i] || room.sides.count(static_cast<tetris::side_t>(i)) == 0;
+    snapshot::encode(part, id, room.frames, taken);
+  }
+
+  std::lock_guard<std::mutex> lock(snapshots.mutex);
+  if (generation != snapshots.generation)
+    return; // the main thread gave up on this one
+  snapshots.rooms.rooms += part.rooms;
+  snapshots.rooms.bytes.insert(snapshots.rooms.bytes.end(), part.bytes.begin(), part.bytes.end());
+  if (--snapshots.pending == 0)
+    snapshots.answered.notify_one();
+}
+
+// players that do not come back within the idle timeout have left; their
+// sides are free again, and a room nobody joined is closed
+static void resume_expired(timer& t)
+{
+  room& room = *static_cast<struct room *>(t.data);
+  room.resume.fill(false);
+  release_room(&room);
+}
+
+// the rooms of the restored snapshot that this worker owns; they wait for
+// their players to join again, for up to idle_timeout_ns
+static void restore_rooms()
+{
+  for (const snapshot::room_t& saved : restored) {
+    if (&owner(saved.id) != self)
+      continue;
+    auto [room_it, _] = rooms.try_emplace(saved.id, saved.id);
+    room& room = room_it->second;
+    room.frames = saved.frames;
+    room.resume = saved.taken;
+    if (idle_timeout_ns != 0) {
+      room.resume_timer.fn = resume_expired;
+      room.resume_timer.data = &room;
+      schedule(room.resume_timer, idle_timeout_ns);
+    }
+  }
+}
+
+static void take_snapshot()
+{
+  const uint64_t start = message::monotonic_ns();
+  std::unique_lock<std::mutex> lock(snapshots.mutex);
+  snapshots.generation++;
+  snapshots.pending = workers.size();
+  snapshots.rooms = {};
+  for (auto& w : workers) {
+    w->snapshot.store(snapshots.generation, std::memory_order_release);
+    uint64_t one = 1;
+    ssize_t ret = write(w->wakeup_fd, &one, (sizeof (one)));
+    passert(ret, "write: wakeup_fd");
+  }
+  if (!snapshots.answered.wait_for(lock, std::chrono::seconds(1), [] { return snapshots.pending == 0; })) {
+    LOG(warn, server, "snapshot: " << snapshots.pending << " workers did not answer");
+    return;
+  }
+  if (!snapshot::write(snapshot_path, snapshots.rooms)) {
+    LOG(warn, server, "snapshot: " << snapshot_path << ": " << std::strerror(errno));
+    return;
+  }
+  LOG(info, server, "snapshot: " << snapshots.rooms.rooms << " rooms, "
+      << snapshots.rooms.bytes.size() << " bytes in " << (message::monotonic_ns() - start) / 1000 << "us");
+}
+
+// handoff
+
+static void push(worker& target, handoff * node)
+{
+  node->next = target.inbox.load(std::memory_order_relaxed);
+  while (!target.inbox.compare_exchange_weak(node->next, node,
+                                             std::memory_order_release,
+                                             std::memory_order_relaxed));
+
+  // the worker drains the whole stack per wakeup, so only the first push signals
+  if (node->next == nullptr) {
+    uint64_t one = 1;
+    ssize_t ret = write(target.wakeup_fd, &one, (sizeof (one)));
+    stats::local.counters.syscalls++;
+    passert(ret, "write: wakeup_fd");
+  }
+}
+
+// pass action, with everything it has buffered, to the owner of its room;
+// the fd must no longer be registered with this worker
+static void hand_off(poll_action& action)
+{
+  stats::local.counters.handoffs++;
+  handoff * node = new handoff;
+  node->fd = action.fd;
+  node->room_id = action.moving_room;
+  node->authoritative = action.authoritative;
+  node->input_seq = action.input_seq;
+  node->extended = action.extended;
+  node->pinging = action.pinging;
+  node->spectator = action.spectator;
+  node->clock = action.clock;
+  node->active = action.active;
+  node->frame_tokens = action.frame_tokens;
+  node->byte_tokens = action.byte_tokens;
+  node->shm = std::move(action.shm);
+  node->recv.resize(action.recv.size());
+  action.recv.peek(node->recv.data(), node->recv.size());
+  node->recv.insert(node->recv.end(), action.overflow.begin(), action.overflow.end());
+  node->send.resize(action.send.size());
+  action.send.peek(node->send.data(), node->send.size());
+  node->queue = std::move(action.queue);
+
+  LOG(debug, server, "fd " << action.fd << " handoff to room " << action.moving_room);
+  worker& target = owner(action.moving_room);
+  clients.erase(action.fd);
+  push(target, node);
+}
+
+// after handling events: close action or hand it off. sockets stay
+// registered edge-triggered for both directions, so there is nothing to re-arm
+static void settle(poll_action& action, bool erase)
+{
+  if (erase) {
+    int ret = close(action.fd);
+    stats::local.counters.syscalls++;
+    if (ret < 0)
+      LOG(warn, net, "close: " << action.fd << ": " << std::strerror(errno));
+    LOG(debug, net, "clients.erase: " << action.fd);
+    room * room = action.room;
+    if (room != nullptr) {
+      leave_room(action);
+      release_room(room);
+    }
+    clients.erase(action.fd);
+  } else if (action.moving) {
+    _epoll_del(action.fd);
+    hand_off(action);
+  }
+}
+
+// write queued frames directly while the socket is known to be writable
+static void flush(poll_action& action)
+{
+  action.dirty = false;
+  if (!action.writable || action.moving || !send_pending(action))
+    return;
+  if (handle_send(action))
+    settle(action, true);
+}
+
+// give a client accepted on the shm socket its channel; false if that failed
+static bool offer_shm(poll_action& action)
+{
+  action.shm = shm::channel::create();
+  if (action.shm == nullptr || !shm::offer(action.fd, *action.shm)) {
+    LOG(warn, net, "shm: " << action.fd << ": " << std::strerror(errno));
+    return false;
+  }
+  return true;
+}
+
+// io_uring backend: a multishot accept per listener, a multishot recv into
+// the worker's provided buffers per connection, and at most one send in
+// flight per connection, flushed once per completion batch
+
+namespace uring_op {
+  enum op : uint32_t { accept, accept_shm, recv, doorbell, send, wakeup, tick, cancel };
+}
+
+static inline uint64_t user_data(uring_op::op op, int fd)
+{
+  return (static_cast<uint64_t>(op) << 32) | static_cast<uint32_t>(fd);
+}
+
+static void uring_accept(int listen_fd, uring_op::op op)
+{
+  struct io_uring_sqe * sqe = _ring->get_sqe();
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = listen_fd;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags = SOCK_CLOEXEC;
+  sqe->user_data = user_data(op, listen_fd);
+}
+
+static void uring_poll(int fd, uring_op::op op)
+{
+  struct io_uring_sqe * sqe = _ring->get_sqe();
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = fd;
+  sqe->poll32_events = POLLIN;
+  sqe->len = IORING_POLL_ADD_MULTI;
+  sqe->user_data = user_data(op, fd);
+}
+
+static void uring_recv(poll_action& action)
+{
+  struct io_uring_sqe * sqe = _ring->get_sqe();
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = action.fd;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = _buffers->group;
+  sqe->user_data = user_data(uring_op::recv, action.fd);
+  action.inflight++;
+  action.receiving = true;
+  action.cancelling = false;
+}
+
+// a shared-memory client only needs its doorbell watched
+static void uring_arm(poll_action& action)
+{
+  if (action.shm == nullptr) {
+    uring_recv(action);
+    return;
+  }
+  uring_poll(action.fd, uring_op::doorbell);
+  action.inflight++;
+}
+
+static void uring_cancel(poll_action& action)
+{
+  struct io_uring_sqe * sqe = _ring->get_sqe();
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->addr = user_data(action.shm ? uring_op::doorbell : uring_op::recv, action.fd);
+  sqe->user_data = user_data(uring_op::cancel, action.fd);
+  action.cancelling = true;
+}
+
+static void uring_flush(poll_action& action)
+{
+  action.dirty = false;
+  if (action.sending || action.moving || action.closing)
+    return; // the send completion flushes again
+
+  if (action.shm) {
+    shm_send(action);
+    return;
+  }
+
+  fill_send(action);
+  if (action.send.empty())
+    return;
+
+  struct io_uring_sqe * sqe = _ring->get_sqe();
+  sqe->opcode = IORING_OP_SEND;
+  sqe->fd = action.fd;
+  // only the contiguous part; bytes that wrapped go with the next flush
+  sqe->addr = reinterpret_cast<uint64_t>(action.send.read_ptr());
+  sqe->len = action.send.read_len();
+  sqe->msg_flags = MSG_NOSIGNAL;
+  sqe->user_data = user_data(uring_op::send, action.fd);
+  action.sending = true;
+  action.inflight++;
+  stats::local.counters.send_calls++;
+}
+
+// append n received bytes to action.recv. a held client's multishot recv
+// runs on until it is cancelled, and what does not fit meanwhile waits in
+// action.overflow; false if the bytes do not fit either
+static bool uring_copy(poll_action& action, const uint8_t * buf, std::size_t n)
+{
+  if (action.overflow.empty() && action.recv.size() + n <= buf_size) {
+    append(action.recv, buf, n);
+    return true;
+  }
+  if (!held(action) || action.overflow.size() + n > queue_hard_limit) {
+    LOG(warn, net, "fd " << action.fd << " recv overflow");
+    return false;
+  }
+  action.overflow.insert(action.overflow.end(), buf, buf + n);
+  if (action.receiving && !action.cancelling)
+    uring_cancel(action); // re-armed once the client catches up
+  return true;
+}
+
+static void uring_close(poll_action& action)
+{
+  int ret = close(action.fd);
+  stats::local.counters.syscalls++;
+  if (ret < 0)
+    LOG(warn, net, "close: " << action.fd << ": " << std::strerror(errno));
+  LOG(debug, net, "clients.erase: " << action.fd);
+  clients.erase(action.fd);
+}
+
+// the uring counterpart of settle(); the fd stays open until nothing is in
+// flight, so its number cannot be reused under a pending completion
+static void uring_settle(poll_action& action, bool erase)
+{
+  if (action.closing) {
+    if (action.inflight == 0)
+      uring_close(action);
+  } else if (erase) {
+    room * room = action.room;
+    if (room != nullptr) {
+      leave_room(action);
+      release_room(room);
+    }
+    action.closing = true;
+    if (action.inflight == 0)
+      uring_close(action);
+    else if (action.shm)
+    {
+      // a hangup does not end a multishot poll
+      if (!action.cancelling)
+        uring_cancel(action);
+    }
+    else
+    {
+      shutdown(action.fd, SHUT_RDWR); // completes the armed recv and any send
+      stats::local.counters.syscalls++;
+    }
+  } else if (action.moving) {
+    if (action.inflight == 0) {
+      hand_off(action);
+    } else if (!action.cancelling) {
+      uring_cancel(action);
+    }
+  } else {
+    mark_dirty(action);
+  }
+}
+
+static void adopt(handoff * node)
+{
+  poll_action * client = clients.emplace(node->fd, poll_action::send_recv);
+  if (client == nullptr) throw "clients.emplace";
+  poll_action& action = *client;
+
+  action.authoritative = node->authoritative;
+  action.input_seq = node->input_seq;
+  action.extended = node->extended;
+  action.pinging = node->pinging;
+  action.spectator = node->spectator;
+  action.clock = node->clock;
+  action.active = node->active;
+  action.frame_tokens = node->frame_tokens;
+  action.byte_tokens = node->byte_tokens;
+  action.shm = std::move(node->shm);
+  action.queue = std::move(node->queue);
+  if (!node->send.empty()) {
+    action.send.reserve(std::max(node->send.size(), initial_buf_size));
+    action.send.write(node->send.data(), node->send.size());
+  }
+  if (!node->recv.empty()) {
+    // the ring is empty, so the bytes are contiguous; a held client may
+    // have brought more than it takes
+    const std::size_t n = std::min<std::size_t>(node->recv.size(), buf_size);
+    action.recv.reserve(n);
+    std::memcpy(action.recv.write_ptr(), node->recv.data(), n);
+    action.recv.commit(n);
+    action.overflow.assign(node->recv.begin() + n, node->recv.end());
+  }
+
+  if (io_backend == backend::uring)
+    uring_arm(action);
+  else
+    _epoll_add(action.fd, EPOLLIN | EPOLLOUT | EPOLLET);
+  join_room(action, node->room_id);
+  delete node;
+  if (action.pinging) {
+    start_pinging(action);
+    watch_idle(action);
+  }
+
+  // frames that arrived behind the _join belong to this worker's room, and
+  // so does anything the old owner left in a channel's ring
+  std::size_t budget = recv_quantum;
+  bool erase = handle_buffered(action, budget);
+  if (!erase && action.shm)
+    erase = shm_recv(action);
+  if (io_backend == backend::uring)
+    uring_settle(action, erase);
+  else
+    settle(action, erase);
+}
+
+static void handle_wakeup()
+{
+  uint64_t count;
+  ssize_t ret = read(self->wakeup_fd, &count, (sizeof (count)));
+  stats::local.counters.syscalls++;
+  if (ret < 0 && errno != EAGAIN)
+    passert(ret, "read: wakeup_fd");
+
+  const uint64_t generation = self->snapshot.exchange(0, std::memory_order_acquire);
+  if (generation != 0)
+    save_rooms(generation);
+
+  // the stack is newest first; adopt in push order
+  handoff * node = self->inbox.exchange(nullptr, std::memory_order_acquire);
+  handoff * reversed = nullptr;
+  while (node != nullptr) {
+    handoff * next = node->next;
+    node->next = reversed;
+    reversed = node;
+    node = next;
+  }
+  while (reversed != nullptr) {
+    handoff * next = reversed->next;
+    adopt(reversed);
+    reversed = next;
+  }
+}
+
+static void uring_complete(const struct io_uring_cqe& cqe)
+{
+  const uring_op::op op = static_cast<uring_op::op>(cqe.user_data >> 32);
+  const int fd = static_cast<int>(static_cast<uint32_t>(cqe.user_data));
+  const bool more = cqe.flags & IORING_CQE_F_MORE;
+
+  switch (op) {
+  case uring_op::accept:
+  case uring_op::accept_shm:
+    {
+      if (cqe.res < 0) {
+        LOG(warn, net, "accept: " << std::strerror(-cqe.res));
+      } else {
+        poll_action * client = clients.emplace(cqe.res, poll_action::send_recv);
+        if (client == nullptr) throw "clients.emplace";
+        poll_action& action = *client;
+
+        if (op == uring_op::accept_shm && !offer_shm(action)) {
+          uring_close(action);
+        } else {
+          LOG(debug, net, "accept " << action.fd << (action.shm ? " shm" : ""));
+          stats::local.counters.accepts++;
+          action.active = message::monotonic_ns();
+          await_join(action);
+          uring_arm(action);
+        }
+      }
+      if (!more)
+        uring_accept(fd, op);
+    }
+    break;
+  case uring_op::wakeup:
+    handle_wakeup();
+    if (!more)
+      uring_poll(fd, uring_op::wakeup);
+    break;
+  case uring_op::tick:
+    handle_tick();
+    if (!more)
+      uring_poll(fd, uring_op::tick);
+    break;
+  case uring_op::cancel:
+    break;
+  case uring_op::recv:
+    {
+      const bool has_buf = cqe.flags & IORING_CQE_F_BUFFER;
+      const uint16_t id = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+      poll_action * client = clients.find(fd);
+      if (client == nullptr) {
+        if (has_buf)
+          _buffers->recycle(id);
+        throw "clients.find";
+      }
+      poll_action& action = *client;
+      if (!more) {
+        action.inflight--;
+        action.receiving = false;
+      }
+
+      bool erase = false;
+      if (cqe.res > 0) {
+        stats::local.counters.bytes_recv += cqe.res;
+        erase = !uring_copy(action, _buffers->buf(id), cqe.res);
+        _buffers->recycle(id);
+        // a batch can hold many completions for one client; its frames
+        // wait for its turn, after the batch
+        if (!erase && !action.closing && !held(action))
+          defer(action);
+      } else if (cqe.res == 0) {
+        erase = true;
+      } else if (cqe.res != -ENOBUFS && cqe.res != -ECANCELED) {
+        LOG(warn, net, "recv: " << fd << ": " << std::strerror(-cqe.res));
+        erase = true;
+      }
+
+      // a held client is re-armed once its turn leaves nothing over
+      if (!more && !erase && !action.closing && !action.moving && !held(action))
+        uring_recv(action);
+      uring_settle(action, erase);
+    }
+    break;
+  case uring_op::doorbell:
+    {
+      poll_action * client = clients.find(fd);
+      if (client == nullptr) throw "clients.find";
+      poll_action& action = *client;
+      if (!more)
+        action.inflight--;
+
+      bool erase = false;
+      if (cqe.res >= 0) {
+        if (!action.closing && !action.moving)
+          erase = shm_recv(action);
+      } else if (cqe.res != -ECANCELED) {
+        LOG(warn, net, "poll: " << fd << ": " << std::strerror(-cqe.res));
+        erase = true;
+      }
+
+      if (!more && !erase && !action.closing && !action.moving)
+        uring_arm(action);
+      uring_settle(action, erase);
+    }
+    break;
+  case uring_op::send:
+    {
+      poll_action * client = clients.find(fd);
+      if (client == nullptr) throw "clients.find";
+      poll_action& action = *client;
+      action.inflight--;
+      action.sending = false;
+
+      bool erase = false;
+      if (cqe.res < 0) {
+        if (!action.closing)
+          LOG(warn, net, "send: " << fd << ": " << std::strerror(-cqe.res));
+        erase = true;
+      } else {
+        stats::local.counters.bytes_sent += cqe.res;
+        // a partial send only consumes what was sent; the rest goes with the next flush
+        action.send.consume(cqe.res);
+        action.send.release();
+      }
+      uring_settle(action, erase);
+    }
+    break;
+  default:
+    throw "unknown uring op";
+  }
+}
+
+static void uring_resume(poll_action& action)
+{
+  bool erase;
+  if (action.shm) {
+    erase = shm_recv(action);
+  } else {
+    std::size_t budget = recv_quantum;
+    erase = handle_buffered(action, budget);
+    if (!action.moving)
+      action.recv.release();
+    if (!erase && !action.moving && !held(action) && !action.receiving)
+      uring_recv(action);
+  }
+  uring_settle(action, erase);
+}
+
+// a turn for every client in the backlog, in the order they were deferred;
+// whoever is still not done goes to the back for the next round
+static void run_backlog()
+{
+  static thread_local std::vector<int> round;
+  round.swap(backlog);
+  for (int fd : round) {
+    poll_action * client = clients.find(fd);
+    if (client == nullptr || !client->backlogged)
+      continue;
+    poll_action& action = *client;
+    action.backlogged = false;
+    if (io_backend == backend::uring) {
+      if (!action.closing)
+        uring_resume(action);
+    } else {
+      settle(action, handle_recv(action));
+    }
+  }
+  round.clear();
+}
+
+// everything queued during an event batch goes out in one send per connection
+static void flush_dirty()
+{
+  for (int fd : dirty) {
+    poll_action * client = clients.find(fd);
+    if (client == nullptr || !client->dirty)
+      continue;
+    if (client->evicting) {
+      client->dirty = false;
+      if (io_backend == backend::uring)
+        uring_settle(*client, true);
+      else
+        settle(*client, true);
+      continue;
+    }
+    if (client->moving) {
+      // placed by a timer, outside its own events
+      client->dirty = false;
+      if (io_backend == backend::uring)
+        uring_settle(*client, false);
+      else
+        settle(*client, false);
+      continue;
+    }
+    stats::local.load.queue_depth.record(client->queue.size());
+    if (io_backend == backend::uring)
+      uring_flush(*client);
+    else
+      flush(*client);
+  }
+  dirty.clear();
+}
+
+static void foo(worker& w)
+{
+  self = &w;
+
+  _epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  passert(_epoll_fd, "epoll_create1");
+
+  auto listen_fd = open_port(5000);
+  if (clients.emplace(listen_fd, poll_action::accept) == nullptr) throw "clients.emplace";
+  _epoll_add(listen_fd, EPOLLIN | EPOLLET);
+
+  if (unix_path != nullptr && &w == workers.front().get()) {
+    auto unix_fd = open_local(unix_path);
+    if (clients.emplace(unix_fd, poll_action::accept) == nullptr) throw "clients.emplace";
+    _epoll_add(unix_fd, EPOLLIN | EPOLLET);
+  }
+  if (shm_path != nullptr && &w == workers.front().get()) {
+    auto shm_fd = open_local(shm_path);
+    if (clients.emplace(shm_fd, poll_action::accept_shm) == nullptr) throw "clients.emplace";
+    _epoll_add(shm_fd, EPOLLIN | EPOLLET);
+  }
+
+  if (clients.emplace(w.wakeup_fd, poll_action::wakeup) == nullptr) throw "clients.emplace";
+  _epoll_add(w.wakeup_fd, EPOLLIN);
+
+  auto wheel = std::make_unique<timing_wheel>(current_tick());
+  _wheel = wheel.get();
+  _timer_fd = open_timer();
+  if (clients.emplace(_timer_fd, poll_action::tick) == nullptr) throw "clients.emplace";
+  _epoll_add(_timer_fd, EPOLLIN);
+
+  restore_rooms();
+
+  std::array<struct epoll_event, 16> events;
+
+  while (1) {
+    // a backlog is worked off between batches, without waiting for events
+    const int ready_count = epoll_wait(_epoll_fd, events.data(), events.size(), backlog.empty() ? -1 : 0);
+    stats::local.counters.syscalls++;
+    if (ready_count < 0 && errno == EINTR)
+      continue;
+    passert(ready_count, "epoll_wait");
+    stats::local.load.batch.record(ready_count);
 
     for (int i = 0; i < ready_count; i++) {
-      auto client_it = clients.find(events[i].data.fd);
-      if (client_it == clients.end()) throw "clients.find";
-      poll_action& action = client_it->second;
+      poll_action * client = clients.find(events[i].data.fd);
+      if (client == nullptr) throw "clients.find";
+      poll_action& action = *client;
 
       switch (action.type) {
       case poll_action::accept:
+      case poll_action::accept_shm:
         {
           while (1) {
             int accept_fd = accept4(action.fd, NULL, NULL, SOCK_NONBLOCK);
+            stats::local.counters.syscalls++;
             if (accept_fd == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
               break;
             passert(accept_fd, "accept4");
 
-            auto [accept_it, ok] = clients.try_emplace(accept_fd, accept_fd, poll_action::send_recv);
-            if (!ok) throw "clients.try_emplace";
-            _epoll_add(accept_fd, EPOLLIN | EPOLLOUT | EPOLLONESHOT);
+            poll_action * accepted = clients.emplace(accept_fd, poll_action::send_recv);
+            if (accepted == nullptr) throw "clients.emplace";
+            if (action.type == poll_action::accept_shm && !offer_shm(*accepted)) {
+              close(accept_fd);
+              clients.erase(accept_fd);
+              continue;
+            }
 
-            // send _side message
-            allocate_side(accept_it->second);
-            std::cerr << "accept " << accept_fd << " side " << static_cast<int>(accept_it->second.side) << '\n';
-            dump::fields(accept_it->second);
-            dump::moves(accept_it->second);
+            LOG(debug, net, "accept " << accept_fd << (accepted->shm ? " shm" : ""));
+            stats::local.counters.accepts++;
+            accepted->active = message::monotonic_ns();
+            await_join(*accepted);
+            _epoll_add(accept_fd, EPOLLIN | EPOLLOUT | EPOLLET);
           }
         }
         break;
       case poll_action::send_recv:
         {
           bool erase = false;
-          if (events[i].events & EPOLLIN)
+          if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
             erase |= handle_recv(action);
-          if (events[i].events & EPOLLOUT)
-            erase |= handle_send(action);
-
-          if (erase) {
-            int ret = close(action.fd);
-            if (ret < 0)
-              std::cerr << "close: " << action.fd << ": " << std::strerror(errno) << '\n';
-            std::cerr << "clients.erase: " << action.fd << '\n';
-            sides.insert(action.side);
-            clients.erase(action.fd);
-          } else {
-            uint32_t epollout = (action.queue.empty() && !action.send.buf_ix) ? 0 : EPOLLOUT;
-            //std::cerr << "fd " << action.fd << " epollout " << epollout << '\n';
-            _epoll_mod(action.fd, epollout);
+          if (!erase && (events[i].events & EPOLLOUT)) {
+            action.writable = true;
+            if (!action.moving && send_pending(action))
+              erase |= handle_send(action);
           }
+
+          settle(action, erase);
         }
         break;
+      case poll_action::wakeup:
+        handle_wakeup();
+        break;
+      case poll_action::tick:
+        handle_tick();
+        break;
       default:
         throw "unknown type";
         break;
       }
     }
+
+    run_backlog();
+    flush_dirty();
   }
 
   close(_epoll_fd);
 }
 
-int main()
+static void foo_uring(worker& w)
 {
-  sides.insert(tetris::side_t::zero);
-  sides.insert(tetris::side_t::one);
-  assert(sides.size() == tetris::frame_count);
-  tetris::init();
+  self = &w;
+
+  uring ring(4096);
+  _ring = &ring;
+  uring_buffers buffers(ring, 0, 1024, 4096);
+  _buffers = &buffers;
 
+  auto listen_fd = open_port(5000);
+  uring_accept(listen_fd, uring_op::accept);
+  if (unix_path != nullptr && &w == workers.front().get())
+    uring_accept(open_local(unix_path), uring_op::accept);
+  if (shm_path != nullptr && &w == workers.front().get())
+    uring_accept(open_local(shm_path), uring_op::accept_shm);
+  uring_poll(w.wakeup_fd, uring_op::wakeup);
+
+  auto wheel = std::make_unique<timing_wheel>(current_tick());
+  _wheel = wheel.get();
+  _timer_fd = open_timer();
+  uring_poll(_timer_fd, uring_op::tick);
+
+  restore_rooms();
+
+  while (1) {
+    // one io_uring_enter submits the previous batch and waits for the next,
+    // unless there is a backlog to work off
+    ring.submit(backlog.empty() ? 1 : 0);
+    stats::local.counters.syscalls++;
+    stats::local.load.batch.record(ring.for_each_cqe(uring_complete));
+
+    run_backlog();
+    flush_dirty();
+  }
+}
+
+static void run(worker& w)
+{
   try {
-    foo();
+    if (io_backend == backend::uring)
+      foo_uring(w);
+    else
+      foo(w);
   } catch (char const* s) {
-    std::cerr << "throw " << s << '\n';
+    LOG(error, server, "throw " << s);
+  } catch (int ret) {
+    LOG(error, server, "throw " << ret);
+  }
+  std::exit(1);
+}
+
+int main(int argc, char * argv[])
+{
+  int worker_count = 1;
+  int opt;
+  int metrics_port = 0;
+  while ((opt = getopt(argc, argv, "t:b:r:v:m:f:B:I:u:s:S:i:")) != -1) {
+    switch (opt) {
+    case 't':
+      worker_count = std::atoi(optarg);
+      break;
+    case 'm':
+      metrics_port = std::atoi(optarg);
+      if (metrics_port < 1 || metrics_port > 65535) {
+        std::cerr << "bad metrics port: " << optarg << '\n';
+        return 1;
+      }
+      break;
+    case 'r':
+      {
+        int hz = std::atoi(optarg);
+        if (hz < 0 || hz > 1000) {
+          std::cerr << "broadcast rate must be 0 to 1000 hz\n";
+          return 1;
+        }
+        broadcast_interval_ns = hz > 0 ? 1'000'000'000 / hz : 0;
+      }
+      break;
+    case 'v':
+      {
+        int hz = std::atoi(optarg);
+        if (hz < 1 || hz > 1000) {
+          std::cerr << "spectator rate must be 1 to 1000 hz\n";
+          return 1;
+        }
+        spectator_interval_ns = 1'000'000'000 / hz;
+      }
+      break;
+    case 'f':
+      frame_rate = std::atof(optarg);
+      if (frame_rate != 0 && frame_rate < 1) {
+        std::cerr << "frame rate must be 0 or at least 1 per second\n";
+        return 1;
+      }
+      break;
+    case 'B':
+      byte_rate = std::atof(optarg);
+      if (byte_rate != 0 && byte_rate < message::max_frame_size) {
+        std::cerr << "byte rate must be 0 or at least " << message::max_frame_size << " per second\n";
+        return 1;
+      }
+      break;
+    case 'I':
+      {
+        int seconds = std::atoi(optarg);
+        if (seconds < 0) {
+          std::cerr << "idle timeout must not be negative\n";
+          return 1;
+        }
+        idle_timeout_ns = seconds * 1'000'000'000ull;
+      }
+      break;
+    case 'u':
+    case 's':
+      if (std::strlen(optarg) >= (sizeof (sockaddr_un::sun_path))) {
+        std::cerr << "socket path too long: " << optarg << '\n';
+        return 1;
+      }
+      (opt == 'u' ? unix_path : shm_path) = optarg;
+      break;
+    case 'S':
+      snapshot_path = optarg;
+      break;
+    case 'i':
+      {
+        int seconds = std::atoi(optarg);
+        if (seconds < 0) {
+          std::cerr << "snapshot interval must not be negative\n";
+          return 1;
+        }
+        snapshot_interval_ns = seconds * 1'000'000'000ull;
+      }
+      break;
+    case 'b':
+      if (std::strcmp(optarg, "epoll") == 0)
+        io_backend = backend::epoll;
+      else if (std::strcmp(optarg, "uring") == 0)
+        io_backend = backend::uring;
+      else {
+        std::cerr << "unknown backend: " << optarg << '\n';
+        return 1;
+      }
+      break;
+    default:
+      std::cerr << "usage: " << argv[0] << " [-t workers] [-b epoll|uring] [-r broadcast hz] [-v spectator hz] [-m metrics port] [-f frames/s] [-B bytes/s] [-I idle seconds] [-u unix socket] [-s shm socket] [-S snapshot file] [-i snapshot seconds]\n";
+      return 1;
+    }
+  }
+  if (worker_count < 1) {
+    std::cerr << "workers must be at least 1\n";
+    return 1;
+  }
+
+  // workers inherit the mask; these signals are only taken here
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR1);
+  if (snapshot_path != nullptr) {
+    sigaddset(&set, SIGUSR2);
+    sigaddset(&set, SIGTERM);
+  }
+  pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+  // every worker exists before any thread runs, so owner() never races
+  for (int i = 0; i < worker_count; i++) {
+    auto w = std::make_unique<worker>();
+    w->wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (w->wakeup_fd < 0) {
+      std::cerr << "eventfd: " << std::strerror(errno) << '\n';
+      return 1;
+    }
+    w->inbox = nullptr;
+    w->snapshot = 0;
+    workers.push_back(std::move(w));
+  }
+
+  if (snapshot_path != nullptr) {
+    const uint64_t start = message::monotonic_ns();
+    if (snapshot::read(snapshot_path, restored))
+      LOG(info, server, "restored " << restored.size() << " rooms from " << snapshot_path
+          << " in " << (message::monotonic_ns() - start) / 1000 << "us");
+    else if (errno != ENOENT)
+      LOG(warn, server, "snapshot: " << snapshot_path << ": " << std::strerror(errno));
+  }
+
+  if (metrics_port != 0 && !metrics::start(metrics_port))
+    return 1;
+  for (auto& w : workers)
+    w->thread = std::thread(run, std::ref(*w));
+
+  LOG(info, server, "workers: " << worker_count
+      << " backend: " << (io_backend == backend::uring ? "uring" : "epoll")
+      << " broadcast interval: " << broadcast_interval_ns / 1000 << "us"
+      << " spectator interval: " << spectator_interval_ns / 1000 << "us");
+
+  uint64_t next_snapshot = snapshot_interval_ns != 0 ? message::monotonic_ns() + snapshot_interval_ns : 0;
+  while (1) {
+    int sig;
+    if (snapshot_path != nullptr && next_snapshot != 0) {
+      const uint64_t now = message::monotonic_ns();
+      if (now >= next_snapshot) {
+        take_snapshot();
+        next_snapshot = now + snapshot_interval_ns;
+        continue;
+      }
+      const struct timespec timeout = {
+        .tv_sec = static_cast<time_t>((next_snapshot - now) / 1'000'000'000),
+        .tv_nsec = static_cast<long>((next_snapshot - now) % 1'000'000'000),
+      };
+      sig = sigtimedwait(&set, NULL, &timeout);
+      if (sig < 0)
+        continue;
+    } else if (sigwait(&set, &sig) != 0) {
+      continue;
+    }
+
+    if (sig == SIGUSR1) {
+      stats::dump(std::cerr);
+    } else if (sig == SIGUSR2) {
+      take_snapshot();
+    } else if (sig == SIGTERM) {
+      // a deploy: keep the matches for the next process
+      take_snapshot();
+      logging::flush();
+      _exit(0);
+    }
   }
 
   return 0;
-}
+}
\ No newline at end of file
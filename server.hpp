@@ -1,35 +1,362 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <optional>
+#include <thread>
 #include <tuple>
+#include <unordered_set>
+#include <vector>
 
+#include "clock_sync.hpp"
 #include "message.hpp"
+#include "pool.hpp"
+#include "ring.hpp"
+#include "shm.hpp"
+#include "wheel.hpp"
 
-constexpr unsigned int buf_size = 65536;
+constexpr unsigned int buf_size = 65536; // largest send or recv buffer
 
-struct buf_index
+// connection buffers start at this size and double on demand
+constexpr std::size_t initial_buf_size = 1024;
+
+using queue_item = std::tuple<message::frame_header_t, message::next_t>;
+
+constexpr uint64_t tick_ns = 1'000'000; // timing wheel resolution
+
+constexpr std::size_t queue_limit = 256 * 1024; // queued bytes before a client counts as behind
+constexpr std::size_t queue_hard_limit = 1024 * 1024; // disconnected at once past this
+constexpr uint64_t queue_grace_ns = 5'000'000'000; // how long a client may stay behind
+
+constexpr uint64_t ping_interval_ns = 1'000'000'000; // between _ping frames to a client
+
+constexpr std::size_t recv_quantum = 4096; // bytes of frames handled per client per turn
+
+// a new client's _hello follows the handshake at once, but a baseline
+// client sends nothing before its _side; it gets the default room after this
+constexpr uint64_t join_grace_ns = 50'000'000;
+
+// frames waiting to be encoded for one client, in two lanes. everything
+// but _move is critical and goes out first, in order. a _move is best
+// effort: a side's position only matters until the next one, so each side
+// keeps at most one, replaced in place, sent once the critical lane is
+// empty. order within a side still holds: a _drop or _next_piece carries
+// the piece and supersedes the side's pending _move, which is dropped; a
+// _field or _attack moves it into the critical lane ahead of itself; any
+// other frame, such as a _join reply, does that for every side; but a
+// _ping or _pong touches no side and leaves the moves where they are
+struct frame_queue
 {
-  uint8_t buf[buf_size];
-  std::size_t buf_ix;
+  std::deque<queue_item> critical;
+  std::array<std::optional<queue_item>, tetris::frame_count> moves; // best effort, by side
+  std::array<uint64_t, tetris::frame_count> move_order; // when each pending _move was first queued
+  uint64_t pushed; // moves queued so far
+  std::size_t bytes; // memory held by items
+
+  frame_queue()
+    : pushed (0)
+    , bytes (0)
+  {
+  }
+
+  bool empty() const { return critical.empty() && next_move() < 0; }
+  std::size_t size() const
+  {
+    std::size_t n = critical.size();
+    for (const auto& move : moves)
+      n += move.has_value();
+    return n;
+  }
+
+  queue_item& front()
+  {
+    return critical.empty() ? *moves[next_move()] : critical.front();
+  }
+
+  // true if item replaced or superseded a pending _move instead of growing the queue
+  bool push(queue_item&& item)
+  {
+    const message::frame_header_t& header = std::get<0>(item);
+    const int side = static_cast<int>(header.side);
+    const bool one_side = side < tetris::frame_count;
+    switch (header.type) {
+    case message::_move:
+      if (one_side) {
+        const bool replaced = moves[side].has_value();
+        if (!replaced) {
+          move_order[side] = pushed++;
+          bytes += (sizeof (queue_item));
+        }
+        moves[side] = std::move(item);
+        return replaced;
+      }
+      break;
+    case message::_drop:
+    case message::_next_piece:
+      if (one_side && moves[side].has_value()) {
+        moves[side].reset();
+        critical.push_back(std::move(item));
+        return true;
+      }
+      break;
+    case message::_field:
+    case message::_attack:
+      if (one_side)
+        promote(side);
+      break;
+    case message::_ping:
+    case message::_pong:
+      break;
+    default:
+      // oldest first
+      for (int next; (next = next_move()) >= 0; )
+        promote(next);
+      break;
+    }
+    critical.push_back(std::move(item));
+    bytes += (sizeof (queue_item));
+    return false;
+  }
+
+  void pop()
+  {
+    if (critical.empty())
+      moves[next_move()].reset();
+    else
+      critical.pop_front();
+    bytes -= (sizeof (queue_item));
+  }
+
+private:
+  // the side whose pending _move is oldest, or -1
+  int next_move() const
+  {
+    int next = -1;
+    for (int i = 0; i < tetris::frame_count; i++)
+      if (moves[i].has_value() && (next < 0 || move_order[i] < move_order[next]))
+        next = i;
+    return next;
+  }
+
+  // send side's pending _move after everything already critical
+  void promote(int side)
+  {
+    if (moves[side].has_value()) {
+      critical.push_back(std::move(*moves[side]));
+      moves[side].reset();
+    }
+  }
 };
 
-using queue_item = std::tuple<message::frame_header_t, message::next_t>;
+// admits work at a sustained rate per second, in bursts of up to a
+// second's worth; a new bucket starts full
+struct token_bucket
+{
+  double tokens;
+  uint64_t refilled; // monotonic_ns()
+
+  token_bucket()
+    : tokens (0)
+    , refilled (0)
+  {
+  }
+
+  // tokens there are at now
+  double level(double rate, uint64_t now)
+  {
+    tokens = std::min(rate, tokens + (now - refilled) * rate / 1e9);
+    refilled = now;
+    return tokens;
+  }
+
+  // nanoseconds until n tokens are there
+  uint64_t wait_ns(double n, double rate) const
+  {
+    return tokens >= n ? 0 : static_cast<uint64_t>((n - tokens) * 1e9 / rate);
+  }
+};
+
+struct poll_action;
+
+// broadcasts waiting for a timed flush: frames in order (origin, header,
+// payload), and the trace of each side's latest _move; the position
+// itself is read at the flush
+struct held_frames
+{
+  std::vector<std::tuple<tetris::side_t, message::frame_header_t, message::next_t>> frames;
+  std::array<std::optional<message::frame_header_t>, tetris::frame_count> moves;
+  timer flush_timer;
+};
+
+// one match: its frames, the sides still free, and everyone who receives its frames
+struct room
+{
+  uint32_t id;
+  std::array<tetris::frame, tetris::frame_count> frames;
+  std::unordered_set<tetris::side_t> sides;
+  std::vector<poll_action *> subscribers; // players, and clients left without a side
+  std::vector<poll_action *> spectators; // joined with _spectate
+
+  held_frames held; // for subscribers, with a broadcast rate set
+  held_frames watched; // for spectators, always
+
+  std::array<bool, tetris::frame_count> resume; // side restored from a snapshot, not yet taken again
+  timer resume_timer; // gives up on the restored sides nobody has taken again
+
+  // frames start zeroed, as the global frames of a single match did;
+  // tetris::init leaves the field and counters alone
+  room(const uint32_t id)
+    : id (id)
+    , frames {}
+  {
+    resume.fill(false);
+    for (auto& frame : frames)
+      tetris::init(frame);
+    for (int i = 0; i < tetris::frame_count; i++)
+      sides.insert(static_cast<tetris::side_t>(i));
+  }
+};
+
+constexpr uint32_t default_room = 0;
 
 struct poll_action
 {
   int fd;
-  enum action { accept, send_recv } type;
-  buf_index send;
-  buf_index recv;
+  enum action { accept, accept_shm, send_recv, wakeup, tick } type;
+  ring_buffer send; // encoded frames not yet sent
+  ring_buffer recv;
+  std::vector<uint8_t> overflow; // io_uring: received while held, past what recv holds
+  std::unique_ptr<shm::channel> shm; // same-host client; fd is its doorbell socket
+  struct room * room;
   tetris::side_t side;
+  bool authoritative; // client sends _input; the server simulates its side
+  uint32_t input_seq; // of the latest _input applied, echoed in _correct
+  bool extended; // negotiated caps::extended_header
+  bool pinging; // negotiated caps::ping
+  bool spectator; // in room->spectators rather than room->subscribers
+  bool keyframe; // spectator needs the whole room before deltas make sense
+  bool moving; // joined a room owned by another worker
+  uint32_t moving_room;
+  timer join_timer; // puts a client that has not asked for a room in the default room
+
+  bool dirty; // queued frames wait for the end-of-batch flush
+  bool evicting; // stayed behind or went idle; closed at the end-of-batch flush
+  uint64_t behind_since; // monotonic_ns() when queue.bytes passed queue_limit, or 0
+  timer behind_timer; // evicts at behind_since + queue_grace_ns
+
+  clock_sync clock; // from our _ping frames and the client's _pong replies
+  timer ping_timer;
+
+  uint64_t active; // monotonic_ns() when frames last arrived
+  timer idle_timer; // due when the client may have been idle for idle_timeout_ns
+
+  // receive fairness: a client gets recv_quantum bytes of frames per turn,
+  // within the rates its buckets allow, and waits for the next turn if it
+  // has more
+  token_bucket frame_tokens;
+  token_bucket byte_tokens;
+  bool backlogged; // used its turn with frames left; in the worker's backlog
+  bool throttled; // out of tokens; throttle_timer puts it back in the backlog
+  timer throttle_timer;
+
+  // epoll backend
+  bool writable; // no EAGAIN since the last EPOLLOUT edge
+
+  // io_uring backend
+  unsigned inflight; // the armed multishot recv and the in-flight send
+  bool receiving; // the multishot recv is armed
+  bool sending;
+  bool cancelling; // recv cancel submitted while moving
+  bool closing; // waiting for inflight to drain before close
 
-  std::queue<queue_item> queue;
+  frame_queue queue;
 
   poll_action(const int fd, const action type)
     : fd (fd)
     , type (type)
   {
-    send.buf_ix = 0;
-    recv.buf_ix = 0;
+    room = nullptr;
     side = tetris::side_t::none;
+    authoritative = false;
+    input_seq = 0;
+    extended = false;
+    pinging = false;
+    spectator = false;
+    keyframe = false;
+    moving = false;
+    moving_room = 0;
+    dirty = false;
+    evicting = false;
+    behind_since = 0;
+    active = 0;
+    backlogged = false;
+    throttled = false;
+    writable = true;
+    inflight = 0;
+    receiving = false;
+    sending = false;
+    cancelling = false;
+    closing = false;
   }
 };
+
+// connections indexed by fd; the kernel hands out the lowest free fd, so
+// the table stays dense and a lookup is one index
+struct client_table
+{
+  std::vector<std::unique_ptr<poll_action>> slots;
+
+  poll_action * find(const int fd)
+  {
+    return static_cast<std::size_t>(fd) < slots.size() ? slots[fd].get() : nullptr;
+  }
+
+  // nullptr if fd is already present
+  poll_action * emplace(const int fd, const poll_action::action type)
+  {
+    if (static_cast<std::size_t>(fd) >= slots.size())
+      slots.resize(std::max<std::size_t>(fd + 1, slots.size() * 2));
+    if (slots[fd])
+      return nullptr;
+    slots[fd] = std::make_unique<poll_action>(fd, type);
+    return slots[fd].get();
+  }
+
+  void erase(const int fd)
+  {
+    slots[fd].reset();
+  }
+};
+
+// a connection in transit to the worker that owns its room
+struct handoff
+{
+  handoff * next;
+  int fd;
+  uint32_t room_id;
+  bool authoritative;
+  uint32_t input_seq;
+  bool extended;
+  bool pinging;
+  bool spectator;
+  clock_sync clock;
+  uint64_t active;
+  token_bucket frame_tokens;
+  token_bucket byte_tokens;
+  std::unique_ptr<shm::channel> shm;
+  std::vector<uint8_t> recv; // received bytes not yet parsed
+  std::vector<uint8_t> send; // encoded bytes not yet sent
+  frame_queue queue;
+};
+
+// one event loop thread; rooms are pinned to a worker by id
+struct worker
+{
+  int wakeup_fd; // eventfd, signalled when inbox goes from empty to non-empty
+  std::atomic<handoff *> inbox; // lock-free stack, pushed by any worker
+  std::atomic<uint64_t> snapshot; // generation of a requested snapshot, or 0
+  std::thread thread;
+};
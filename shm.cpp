@@ -0,0 +1,211 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <new>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "local_socket.hpp"
+#include "shm.hpp"
+
+static_assert((shm::ring_size & (shm::ring_size - 1)) == 0);
+static_assert(std::atomic<uint64_t>::is_always_lock_free);
+
+shm::channel::channel(segment * seg, bool server)
+  : seg (seg)
+  , rx (seg->rings[server ? 0 : 1])
+  , tx (seg->rings[server ? 1 : 0])
+  , memfd (-1)
+{
+}
+
+shm::channel::~channel()
+{
+  munmap(seg, (sizeof (segment)));
+  if (memfd >= 0)
+    close(memfd);
+}
+
+std::unique_ptr<shm::channel> shm::channel::create()
+{
+  int fd = memfd_create("tetris", MFD_CLOEXEC);
+  if (fd < 0)
+    return nullptr;
+  if (ftruncate(fd, (sizeof (segment))) < 0) {
+    close(fd);
+    return nullptr;
+  }
+  void * p = mmap(NULL, (sizeof (segment)), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED) {
+    close(fd);
+    return nullptr;
+  }
+
+  // a fresh memfd is zeroed; both sides start out asleep, so the first
+  // write in either direction rings
+  segment * seg = new (p) segment;
+  seg->magic = magic;
+  seg->ring_size = ring_size;
+  for (ring& r : seg->rings)
+    r.sleeping.store(1, std::memory_order_relaxed);
+
+  std::unique_ptr<channel> c(new channel(seg, true));
+  c->memfd = fd;
+  return c;
+}
+
+std::unique_ptr<shm::channel> shm::channel::attach(int memfd)
+{
+  void * p = mmap(NULL, (sizeof (segment)), PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+  close(memfd);
+  if (p == MAP_FAILED)
+    return nullptr;
+  segment * seg = static_cast<segment *>(p);
+  if (seg->magic != magic || seg->ring_size != ring_size) {
+    munmap(p, (sizeof (segment)));
+    errno = EPROTO;
+    return nullptr;
+  }
+  return std::unique_ptr<channel>(new channel(seg, false));
+}
+
+std::size_t shm::channel::write(const uint8_t * in, std::size_t n)
+{
+  const uint64_t tail = tx.tail.load(std::memory_order_relaxed);
+  const uint64_t head = tx.head.load(std::memory_order_acquire);
+  n = std::min(n, ring_size - static_cast<std::size_t>(tail - head));
+  if (n == 0)
+    return 0;
+  const std::size_t offset = tail & (ring_size - 1);
+  const std::size_t first = std::min(n, ring_size - offset);
+  std::memcpy(tx.data + offset, in, first);
+  std::memcpy(tx.data, in + first, n - first);
+  tx.tail.store(tail + n, std::memory_order_release);
+  return n;
+}
+
+std::size_t shm::channel::read(uint8_t * out, std::size_t n)
+{
+  const uint64_t head = rx.head.load(std::memory_order_relaxed);
+  const uint64_t tail = rx.tail.load(std::memory_order_acquire);
+  n = std::min(n, static_cast<std::size_t>(tail - head));
+  if (n == 0)
+    return 0;
+  const std::size_t offset = head & (ring_size - 1);
+  const std::size_t first = std::min(n, ring_size - offset);
+  std::memcpy(out, rx.data + offset, first);
+  std::memcpy(out + first, rx.data, n - first);
+  rx.head.store(head + n, std::memory_order_release);
+  return n;
+}
+
+// each side stores its flag, then loads the other's position; the fences
+// order the two, so either the waiter sees the new position or the peer
+// sees the flag and rings
+
+bool shm::channel::sleep()
+{
+  rx.sleeping.store(1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (rx.tail.load(std::memory_order_acquire) != rx.head.load(std::memory_order_relaxed)) {
+    rx.sleeping.store(0, std::memory_order_relaxed);
+    return false;
+  }
+  return true;
+}
+
+bool shm::channel::block()
+{
+  tx.blocked.store(1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (tx.tail.load(std::memory_order_relaxed) - tx.head.load(std::memory_order_acquire) < ring_size) {
+    tx.blocked.store(0, std::memory_order_relaxed);
+    return false;
+  }
+  return true;
+}
+
+bool shm::channel::wake()
+{
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  bool ring = false;
+  if (tx.sleeping.load(std::memory_order_relaxed) != 0 && tx.tail.load(std::memory_order_relaxed) != tx.head.load(std::memory_order_relaxed))
+    ring |= tx.sleeping.exchange(0, std::memory_order_relaxed) != 0;
+  if (rx.blocked.load(std::memory_order_relaxed) != 0)
+    ring |= rx.blocked.exchange(0, std::memory_order_relaxed) != 0;
+  return ring;
+}
+
+bool shm::offer(int fd, channel& c)
+{
+  uint32_t hello[2] = { magic, static_cast<uint32_t>(ring_size) };
+  struct iovec iov = { .iov_base = hello, .iov_len = (sizeof (hello)) };
+  alignas(struct cmsghdr) char control[CMSG_SPACE((sizeof (int)))] = {};
+  struct msghdr msg = {};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = (sizeof (control));
+  struct cmsghdr * cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN((sizeof (int)));
+  std::memcpy(CMSG_DATA(cmsg), &c.memfd, (sizeof (int)));
+
+  ssize_t ret = sendmsg(fd, &msg, MSG_NOSIGNAL);
+  if (ret != (sizeof (hello)))
+    return false;
+  close(c.memfd);
+  c.memfd = -1;
+  return true;
+}
+
+std::unique_ptr<shm::channel> shm::connect(const char * path, int& fd)
+{
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return nullptr;
+
+  struct sockaddr_un addr;
+  const socklen_t addrlen = local_address(path, addr);
+
+  uint32_t hello[2];
+  struct iovec iov = { .iov_base = hello, .iov_len = (sizeof (hello)) };
+  alignas(struct cmsghdr) char control[CMSG_SPACE((sizeof (int)))] = {};
+  struct msghdr msg = {};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = (sizeof (control));
+
+  int memfd = -1;
+  if (::connect(fd, (struct sockaddr *)&addr, addrlen) == 0
+      && recvmsg(fd, &msg, MSG_CMSG_CLOEXEC | MSG_WAITALL) == (sizeof (hello))) {
+    struct cmsghdr * cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg != nullptr && cmsg->cmsg_type == SCM_RIGHTS)
+      std::memcpy(&memfd, CMSG_DATA(cmsg), (sizeof (int)));
+  }
+  if (memfd < 0 || hello[0] != magic || hello[1] != ring_size) {
+    if (memfd >= 0)
+      close(memfd);
+    close(fd);
+    return nullptr;
+  }
+
+  std::unique_ptr<channel> c = channel::attach(memfd);
+  if (c == nullptr) {
+    close(fd);
+    return nullptr;
+  }
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  return c;
+}
+
+void shm::ring_doorbell(int fd)
+{
+  const uint8_t bell = 1;
+  (void)::send(fd, &bell, 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+// same-host transport: a memfd shared with the peer holds one
+// single-producer single-consumer byte ring per direction, carrying the
+// same frames a socket would. the unix socket that passed the memfd stays
+// open as the doorbell: a byte on it means "look at the rings", and it is
+// only written when the peer said it was about to sleep, so a busy channel
+// makes no syscalls. its hangup is the peer's
+
+namespace shm {
+  constexpr std::size_t ring_size = 65536; // bytes per direction, power of two
+  constexpr uint32_t magic = 0x7465746d; // "tetm"
+
+  struct ring {
+    alignas(64) std::atomic<uint64_t> head; // consumer
+    alignas(64) std::atomic<uint64_t> tail; // producer
+    alignas(64) std::atomic<uint32_t> sleeping; // consumer waits for the doorbell before reading on
+    std::atomic<uint32_t> blocked; // producer waits for the doorbell before writing on
+    alignas(64) uint8_t data[ring_size];
+  };
+
+  struct segment {
+    uint32_t magic;
+    uint32_t ring_size;
+    ring rings[2]; // 0: client to server, 1: server to client
+  };
+
+  // one end of a channel; the same calls serve both sides
+  class channel {
+    segment * seg;
+    ring& rx;
+    ring& tx;
+
+    channel(segment * seg, bool server);
+
+  public:
+    int memfd; // until offered to the peer
+
+    channel(const channel&) = delete;
+    channel& operator=(const channel&) = delete;
+    ~channel();
+
+    // server side: a new segment, to be passed with offer()
+    static std::unique_ptr<channel> create();
+    // client side: the segment received by accept()
+    static std::unique_ptr<channel> attach(int memfd);
+
+    // bytes copied in or out; never blocks
+    std::size_t write(const uint8_t * in, std::size_t n);
+    std::size_t read(uint8_t * out, std::size_t n);
+
+    // announce a wait for more input or for space; false if there already
+    // is some, in which case the caller carries on instead
+    bool sleep();
+    bool block();
+
+    // true if the peer waits on what was just written or read, and has
+    // to be woken with a doorbell byte; call once per batch
+    bool wake();
+  };
+
+  // send the memfd over the unix socket fd, and close it; false on error
+  bool offer(int fd, channel& c);
+  // connect to the server's unix socket at path and map the segment it
+  // offers; fd is the doorbell socket, left non-blocking. nullptr on error
+  std::unique_ptr<channel> connect(const char * path, int& fd);
+
+  // write one doorbell byte to fd; a full socket already holds one
+  void ring_doorbell(int fd);
+}
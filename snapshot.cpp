@@ -0,0 +1,261 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bswap.hpp"
+#include "message.hpp"
+#include "snapshot.hpp"
+
+namespace {
+  constexpr uint32_t magic = 0x74736e70; // "tsnp"
+  constexpr uint32_t version = 1;
+
+  struct header_t {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t rooms;
+    uint32_t length; // bytes of records that follow
+    uint32_t checksum; // fnv-1a of the records
+  };
+
+  constexpr std::size_t header_size = 5 * (sizeof (uint32_t));
+
+  uint32_t fnv1a(const uint8_t * p, std::size_t n)
+  {
+    uint32_t h = 2166136261u;
+    for (std::size_t i = 0; i < n; i++)
+      h = (h ^ p[i]) * 16777619u;
+    return h;
+  }
+
+  struct writer {
+    std::vector<uint8_t>& out;
+
+    void u8(uint8_t v) { out.push_back(v); }
+    void u16(uint16_t v)
+    {
+      v = bswap::hton(v);
+      out.insert(out.end(), (uint8_t *)&v, (uint8_t *)&v + (sizeof (v)));
+    }
+    void u32(uint32_t v)
+    {
+      v = bswap::hton(v);
+      out.insert(out.end(), (uint8_t *)&v, (uint8_t *)&v + (sizeof (v)));
+    }
+    uint8_t * take(std::size_t n)
+    {
+      out.resize(out.size() + n);
+      return out.data() + out.size() - n;
+    }
+  };
+
+  // every read is bounds checked; a short record leaves ok false
+  struct reader {
+    const uint8_t * p;
+    const uint8_t * end;
+    bool ok = true;
+
+    const uint8_t * take(std::size_t n)
+    {
+      if (!ok || static_cast<std::size_t>(end - p) < n) {
+        ok = false;
+        static const uint8_t zero[message::field::size] = {};
+        return zero;
+      }
+      const uint8_t * q = p;
+      p += n;
+      return q;
+    }
+    uint8_t u8() { return *take(1); }
+    uint16_t u16()
+    {
+      uint16_t v;
+      std::memcpy(&v, take((sizeof (v))), (sizeof (v)));
+      return bswap::ntoh(v);
+    }
+    uint32_t u32()
+    {
+      uint32_t v;
+      std::memcpy(&v, take((sizeof (v))), (sizeof (v)));
+      return bswap::ntoh(v);
+    }
+  };
+
+  void encode_frame(writer& w, const tetris::frame& frame)
+  {
+    message::field::encode(frame.field, w.take(message::field::size));
+    message::piece::encode(frame.piece, w.take(message::piece::size));
+    w.u8(static_cast<uint8_t>(frame.piece.lock_delay.moves));
+    w.u8(frame.piece.lock_delay.locking);
+    w.u8(static_cast<uint8_t>(frame.swap));
+    w.u8(frame.swapped);
+    w.u32(static_cast<uint32_t>(frame.points));
+    w.u32(static_cast<uint32_t>(frame.level));
+
+    w.u16(static_cast<uint16_t>(frame.queue.size()));
+    for (tetris::tet tet : frame.queue)
+      w.u8(static_cast<uint8_t>(tet));
+
+    // sorted, so that equal rooms give equal bytes
+    std::vector<tetris::tet> bag(frame.bag.begin(), frame.bag.end());
+    std::sort(bag.begin(), bag.end());
+    w.u16(static_cast<uint16_t>(bag.size()));
+    for (tetris::tet tet : bag)
+      w.u8(static_cast<uint8_t>(tet));
+
+    w.u32(static_cast<uint32_t>(frame.garbage.total));
+    w.u16(static_cast<uint16_t>(frame.garbage.attacks.size()));
+    for (const tetris::attack_t& attack : frame.garbage.attacks)
+      message::attack::encode(attack, w.take(message::attack::size));
+  }
+
+  void decode_frame(reader& r, tetris::frame& frame)
+  {
+    const auto now = tetris::clock::now();
+
+    message::field::decode(r.take(message::field::size), frame.field);
+    message::piece::decode(r.take(message::piece::size), frame.piece);
+    frame.piece.lock_delay.moves = r.u8();
+    frame.piece.lock_delay.locking = r.u8() != 0;
+    frame.piece.lock_delay.point = now;
+    frame.swap = static_cast<tetris::tet>(r.u8());
+    frame.swapped = r.u8() != 0;
+    frame.points = static_cast<int>(r.u32());
+    frame.level = static_cast<int>(r.u32());
+    frame.point = now;
+
+    frame.queue.resize(r.u16());
+    for (tetris::tet& tet : frame.queue)
+      tet = static_cast<tetris::tet>(r.u8());
+
+    frame.bag.clear();
+    for (uint16_t n = r.u16(); n > 0 && r.ok; n--)
+      frame.bag.insert(static_cast<tetris::tet>(r.u8()));
+
+    frame.garbage.total = static_cast<int>(r.u32());
+    frame.garbage.attacks.clear();
+    for (uint16_t n = r.u16(); n > 0 && r.ok; n--) {
+      tetris::attack_t attack;
+      message::attack::decode(r.take(message::attack::size), attack);
+      frame.garbage.attacks.push_back(attack);
+    }
+  }
+}
+
+void snapshot::encode(part& out, uint32_t id,
+                      const std::array<tetris::frame, tetris::frame_count>& frames,
+                      const std::array<bool, tetris::frame_count>& taken)
+{
+  writer w{out.bytes};
+  w.u32(id);
+  uint8_t mask = 0;
+  for (int i = 0; i < tetris::frame_count; i++)
+    mask |= taken[i] << i;
+  w.u8(mask);
+  for (const tetris::frame& frame : frames)
+    encode_frame(w, frame);
+  out.rooms++;
+}
+
+bool snapshot::write(const char * path, const part& rooms)
+{
+  const std::string tmp = std::string(path) + ".tmp";
+  const std::size_t size = header_size + rooms.bytes.size();
+
+  int fd = open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0)
+    return false;
+  if (ftruncate(fd, size) < 0) {
+    close(fd);
+    return false;
+  }
+  void * p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED)
+    return false;
+
+  uint8_t * buf = static_cast<uint8_t *>(p);
+  const uint32_t header[] = {
+    bswap::hton(magic),
+    bswap::hton(version),
+    bswap::hton(rooms.rooms),
+    bswap::hton(static_cast<uint32_t>(rooms.bytes.size())),
+    bswap::hton(fnv1a(rooms.bytes.data(), rooms.bytes.size())),
+  };
+  static_assert((sizeof (header)) == header_size);
+  std::memcpy(buf, header, header_size);
+  if (!rooms.bytes.empty())
+    std::memcpy(buf + header_size, rooms.bytes.data(), rooms.bytes.size());
+
+  const bool synced = msync(p, size, MS_SYNC) == 0;
+  munmap(p, size);
+  if (!synced)
+    return false;
+  if (rename(tmp.c_str(), path) < 0)
+    return false;
+
+  // the rename is only durable once the directory holding it is synced
+  const std::string name(path);
+  const std::size_t slash = name.rfind('/');
+  const std::string dir = slash == std::string::npos ? "." : slash == 0 ? "/" : name.substr(0, slash);
+  fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0)
+    return false;
+  const bool dir_synced = fsync(fd) == 0;
+  close(fd);
+  return dir_synced;
+}
+
+bool snapshot::read(const char * path, std::vector<room_t>& rooms)
+{
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return false;
+  struct stat st;
+  if (fstat(fd, &st) < 0 || static_cast<std::size_t>(st.st_size) < header_size) {
+    close(fd);
+    return false;
+  }
+  const std::size_t size = st.st_size;
+  void * p = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED)
+    return false;
+
+  const uint8_t * buf = static_cast<const uint8_t *>(p);
+  reader r{buf, buf + size};
+  header_t header;
+  header.magic = r.u32();
+  header.version = r.u32();
+  header.rooms = r.u32();
+  header.length = r.u32();
+  header.checksum = r.u32();
+  bool ok = header.magic == magic && header.version == version
+    && header.length == size - header_size
+    && header.checksum == fnv1a(buf + header_size, header.length);
+
+  for (uint32_t i = 0; ok && i < header.rooms; i++) {
+    room_t room;
+    room.id = r.u32();
+    const uint8_t mask = r.u8();
+    for (int j = 0; j < tetris::frame_count; j++)
+      room.taken[j] = (mask >> j) & 1;
+    for (tetris::frame& frame : room.frames)
+      decode_frame(r, frame);
+    ok = r.ok;
+    if (ok)
+      rooms.push_back(std::move(room));
+  }
+  munmap(p, size);
+  if (!ok) {
+    rooms.clear();
+    errno = EINVAL;
+  }
+  return ok;
+}
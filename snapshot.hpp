@@ -0,0 +1,35 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <vector>
+
+#include "tetris.hpp"
+
+// room state on disk, so that a restarted server picks its matches back
+// up. a snapshot is a header and one record per room in network byte
+// order; it is written to a temporary file through mmap and renamed over
+// the previous one, so a reader only ever sees a whole snapshot
+
+namespace snapshot {
+  struct room_t {
+    uint32_t id;
+    std::array<tetris::frame, tetris::frame_count> frames;
+    std::array<bool, tetris::frame_count> taken; // a player held the side
+  };
+
+  // records for some rooms, gathered before they are written
+  struct part {
+    uint32_t rooms = 0;
+    std::vector<uint8_t> bytes;
+  };
+
+  void encode(part& out, uint32_t id,
+              const std::array<tetris::frame, tetris::frame_count>& frames,
+              const std::array<bool, tetris::frame_count>& taken);
+
+  // false on error, with errno set
+  bool write(const char * path, const part& rooms);
+  // false if path holds no usable snapshot; time points restart at now
+  bool read(const char * path, std::vector<room_t>& rooms);
+}
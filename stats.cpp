@@ -0,0 +1,125 @@
+#include <algorithm>
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+#include "stats.hpp"
+
+static std::mutex registry_mutex;
+static std::vector<stats::thread_t *> registry;
+
+thread_local stats::thread_t stats::local;
+
+stats::thread_t::thread_t()
+{
+  std::lock_guard<std::mutex> lock(registry_mutex);
+  registry.push_back(this);
+}
+
+stats::thread_t::~thread_t()
+{
+  std::lock_guard<std::mutex> lock(registry_mutex);
+  registry.erase(std::find(registry.begin(), registry.end(), this));
+}
+
+static double _ratio(uint64_t n, uint64_t d)
+{
+  return d == 0 ? 0.0 : static_cast<double>(n) / static_cast<double>(d);
+}
+
+static const char * const type_names[message::_last] = {
+  "field", "side", "next_piece", "move", "drop", "attack", "input", "hello", "join", "spectate",
+  "ping", "pong", "correct",
+};
+
+static void _sum(uint64_t (&total)[message::_last], const stats::by_type& counts)
+{
+  for (int i = 0; i < message::_last; i++)
+    total[i] += counts[i].load();
+}
+
+static void _dump(std::ostream& os, const char * name, const uint64_t (&counts)[message::_last])
+{
+  for (int i = 0; i < message::_last; i++)
+    os << name << '_' << type_names[i] << ' ' << counts[i] << '\n';
+}
+
+void stats::dump(std::ostream& os)
+{
+  uint64_t send_calls = 0;
+  uint64_t frames_sent = 0;
+  uint64_t frames_sent_by_type[message::_last] = {};
+  uint64_t bytes_sent = 0;
+  uint64_t frames_recv = 0;
+  uint64_t frames_recv_by_type[message::_last] = {};
+  uint64_t bytes_recv = 0;
+  uint64_t accepts = 0;
+  uint64_t handoffs = 0;
+  uint64_t syscalls = 0;
+  uint64_t moves_coalesced = 0;
+  uint64_t evictions = 0;
+  uint64_t idle_closed = 0;
+  uint64_t spectator_resyncs = 0;
+  uint64_t doorbells = 0;
+  uint64_t frames_throttled = 0;
+  histogram recv;
+  histogram broadcast;
+  histogram rtt;
+  histogram batch;
+  histogram queue_depth;
+  histogram room_flush;
+
+  {
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    for (thread_t * thread : registry) {
+      send_calls += thread->counters.send_calls.load();
+      frames_sent += thread->counters.frames_sent.load();
+      _sum(frames_sent_by_type, thread->counters.frames_sent_by_type);
+      bytes_sent += thread->counters.bytes_sent.load();
+      frames_recv += thread->counters.frames_recv.load();
+      _sum(frames_recv_by_type, thread->counters.frames_recv_by_type);
+      bytes_recv += thread->counters.bytes_recv.load();
+      accepts += thread->counters.accepts.load();
+      handoffs += thread->counters.handoffs.load();
+      syscalls += thread->counters.syscalls.load();
+      moves_coalesced += thread->counters.moves_coalesced.load();
+      evictions += thread->counters.evictions.load();
+      idle_closed += thread->counters.idle_closed.load();
+      spectator_resyncs += thread->counters.spectator_resyncs.load();
+      doorbells += thread->counters.doorbells.load();
+      frames_throttled += thread->counters.frames_throttled.load();
+      recv.merge(thread->latency.recv);
+      broadcast.merge(thread->latency.broadcast);
+      rtt.merge(thread->latency.rtt);
+      batch.merge(thread->load.batch);
+      queue_depth.merge(thread->load.queue_depth);
+      room_flush.merge(thread->load.room_flush);
+    }
+  }
+
+  os << "send_calls " << send_calls << '\n'
+     << "frames_sent " << frames_sent << '\n';
+  _dump(os, "frames_sent", frames_sent_by_type);
+  os << "bytes_sent " << bytes_sent << '\n'
+     << "send_calls_per_frame " << _ratio(send_calls, frames_sent) << '\n'
+     << "frames_recv " << frames_recv << '\n';
+  _dump(os, "frames_recv", frames_recv_by_type);
+  os << "bytes_recv " << bytes_recv << '\n'
+     << "accepts " << accepts << '\n'
+     << "handoffs " << handoffs << '\n'
+     << "syscalls " << syscalls << '\n'
+     << "syscalls_per_frame " << _ratio(syscalls, frames_sent + frames_recv) << '\n'
+     << "moves_coalesced " << moves_coalesced << '\n'
+     << "evictions " << evictions << '\n'
+     << "idle_closed " << idle_closed << '\n'
+     << "spectator_resyncs " << spectator_resyncs << '\n'
+     << "doorbells " << doorbells << '\n'
+     << "frames_throttled " << frames_throttled << '\n';
+  recv.dump(os, "latency_recv_ns");
+  broadcast.dump(os, "latency_broadcast_ns");
+  rtt.dump(os, "latency_rtt_ns");
+  batch.dump(os, "batch_size");
+  queue_depth.dump(os, "queue_depth");
+  room_flush.dump(os, "room_flush_ns");
+}
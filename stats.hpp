@@ -0,0 +1,73 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <ostream>
+
+#include "histogram.hpp"
+#include "message.hpp"
+
+namespace stats {
+  // written only by the owning thread; dump() reads it from any thread
+  struct counter {
+    std::atomic<uint64_t> value{0};
+
+    void operator++(int) { *this += 1; }
+    void operator+=(uint64_t n)
+    {
+      value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+    uint64_t load() const { return value.load(std::memory_order_relaxed); }
+  };
+
+  using by_type = std::array<counter, message::_last>;
+
+  struct counters_t {
+    counter send_calls;
+    counter frames_sent;
+    by_type frames_sent_by_type;
+    counter bytes_sent;
+    counter frames_recv;
+    by_type frames_recv_by_type;
+    counter bytes_recv;
+    counter accepts;
+    counter handoffs; // clients passed to the worker that owns their room
+    counter syscalls; // every syscall on the event loop path, epoll_ctl included
+    counter moves_coalesced; // queued _move frames replaced by a newer one, or superseded by a _drop or _next_piece
+    counter evictions; // clients disconnected for staying behind
+    counter idle_closed; // clients disconnected for sending nothing, the side freed
+    counter spectator_resyncs; // spectators too far behind for a delta, sent a keyframe instead
+    counter doorbells; // wakeups written to shared-memory clients
+    counter frames_throttled; // times a client's frames were held back by its token buckets
+  };
+
+  // latency of traced frames in nanoseconds, measured from the origin send,
+  // and round trips to clients
+  struct latency_t {
+    histogram recv;      // origin send -> server recv
+    histogram broadcast; // origin send -> server send to a peer
+    histogram rtt;       // server _ping -> client _pong, less the client's turnaround
+  };
+
+  // how busy a worker is; these saturate before latency does
+  struct load_t {
+    histogram batch;       // events per epoll_wait, or completions per io_uring_enter
+    histogram queue_depth; // frames queued for a client when it is flushed
+    histogram room_flush;  // nanoseconds spent in one rate-limited room flush
+  };
+
+  // each thread updates its own copy, so workers never share a cache line
+  struct thread_t {
+    counters_t counters;
+    latency_t latency;
+    load_t load;
+
+    thread_t();
+    ~thread_t();
+  };
+
+  extern thread_local thread_t local;
+
+  void dump(std::ostream& os);
+}
@@ -2,13 +2,13 @@
 #include <cassert>
 #include <chrono>
 #include <cmath>
-#include <iostream>
 #include <queue>
 #include <random>
 #include <set>
 
 #include "tetris.hpp"
 #include "client.hpp"
+#include "log.hpp"
 
 #define THIS_FRAME (tetris::frames[(int)tetris::this_side])
 
@@ -101,8 +101,9 @@ static const kick_table_t& kick_offsets(tetris::tet t)
   }
 }
 
-static auto seed = std::chrono::system_clock::now().time_since_epoch().count();
-static std::default_random_engine generator (seed);
+// per thread, so server workers can simulate rooms without sharing state
+static thread_local auto seed = std::chrono::system_clock::now().time_since_epoch().count();
+static thread_local std::default_random_engine generator (seed);
 
 std::uniform_int_distribution<int> tet_distribution(0, (int)tetris::tet::empty - 1);
 
@@ -118,12 +119,12 @@ static void reset_field(tetris::field& field)
       fill(field[i][j], i, j);
 }
 
-static int _bag = 0;
+static thread_local int _bag = 0;
 
 static void refill_bag(tetris::bag& bag)
 {
   if (bag.size() == 0) {
-    std::cerr << "bag " << _bag++ << '\n';
+    LOG(trace, engine, "bag " << _bag++);
     tetris::bag::iterator it = bag.end();
     for (int i = 0; i != (int)tetris::tet::empty; i++) {
       tetris::tet t = static_cast<tetris::tet>(i);
@@ -149,27 +150,27 @@ static tetris::tet next_tet(tetris::frame& f)
   return next;
 }
 
-static bool collision(tetris::piece& p)
+static bool collision(const tetris::field& field, const tetris::piece& p)
 {
-  assert(tetris::this_side != tetris::side_t::none);
-
   const tetris::coord * offset = tetris::offsets[(int)p.tet][(int)p.facing];
 
   for (int i = 0; i < 4; i++) {
     int q = p.pos.u + offset[i].u;
     int r = p.pos.v + offset[i].v;
 
-    tetris::cell cell = THIS_FRAME.field[q][r];
-    if (cell.color != tetris::tet::empty || q == -1 || q == tetris::columns || r == -1 || r == tetris::rows)
+    if (q < 0 || q >= tetris::columns || r < 0 || r >= tetris::rows)
+      return true;
+    const tetris::cell& cell = field[q][r];
+    if (cell.color != tetris::tet::empty)
       return true;
   }
   return false;
 }
 
-static void update_drop_row(tetris::piece& piece) {
+static void update_drop_row(tetris::field& field, tetris::piece& piece) {
   tetris::piece p = piece;
-  assert(!collision(piece));
-  while (!collision(p))
+  assert(!collision(field, piece));
+  while (!collision(field, p))
     p.pos.v -= 1;
   piece.drop_row = p.pos.v + 1;
 }
@@ -184,30 +185,51 @@ static void _next_piece(tetris::piece& p, tetris::tet t)
   p.lock_delay.locking = false;
 }
 
-void tetris::swap()
+// a new piece at the top of the field; false if it has no room there,
+// which ends the game
+static bool spawn(tetris::frame& frame, tetris::tet t)
 {
-  assert(tetris::this_side != tetris::side_t::none);
+  _next_piece(frame.piece, t);
+  if (collision(frame.field, frame.piece))
+    return false;
+  update_drop_row(frame.field, frame.piece);
+  return true;
+}
 
-  THIS_FRAME.swapped = true;
-  tetris::tet swap = THIS_FRAME.swap;
-  THIS_FRAME.swap = THIS_FRAME.piece.tet;
+bool tetris::swap(tetris::frame& frame)
+{
+  frame.swapped = true;
+  tetris::tet swap = frame.swap;
+  frame.swap = frame.piece.tet;
   if (swap == tetris::tet::empty)
-    _next_piece(THIS_FRAME.piece, next_tet(THIS_FRAME));
+    return spawn(frame, next_tet(frame));
   else
-    _next_piece(THIS_FRAME.piece, swap);
-  update_drop_row(THIS_FRAME.piece);
+    return spawn(frame, swap);
 }
 
-void tetris::event_reset_frame(tetris::side_t side)
+bool tetris::swap()
+{
+  assert(tetris::this_side != tetris::side_t::none);
+
+  return tetris::swap(THIS_FRAME);
+}
+
+void tetris::reset_frame(tetris::frame& frame)
 {
-  tetris::frame& frame = frames[(int)side];
   reset_field(frame.field);
-  _next_piece(frame.piece, next_tet(frame));
-  update_drop_row(frame.piece);
+  frame.garbage.attacks.clear();
+  frame.garbage.total = 0;
+  spawn(frame, next_tet(frame));
   frame.swap = tetris::tet::empty;
+  frame.swapped = false;
   frame.level = 1;
 }
 
+void tetris::event_reset_frame(tetris::side_t side)
+{
+  tetris::reset_frame(frames[(int)side]);
+}
+
 
 static int clear_lines(tetris::field& field, tetris::piece& piece)
 {
@@ -296,27 +318,35 @@ int tetris::place(tetris::frame& frame) {
   frame.points += points;
   if (frame.points > points::next_level(frame.level)) {
     frame.level++;
-    std::cerr << "level " << frame.level << '\n';
+    LOG(debug, engine, "level " << frame.level);
   }
   return cleared;
 }
 
+int tetris::drop(tetris::frame& frame)
+{
+  frame.swapped = false;
+  frame.piece.pos.v = frame.piece.drop_row;
+  return tetris::place(frame);
+}
+
 void tetris::drop()
 {
   assert(tetris::this_side != tetris::side_t::none);
 
-  THIS_FRAME.swapped = false;
-  THIS_FRAME.piece.pos.v = THIS_FRAME.piece.drop_row;
-  tetris::place(THIS_FRAME);
+  tetris::drop(THIS_FRAME);
 }
 
-void tetris::next_piece()
+bool tetris::next_piece(tetris::frame& frame)
 {
-  assert(tetris::this_side != tetris::side_t::none);
+  return spawn(frame, next_tet(frame));
+}
 
-  _next_piece(THIS_FRAME.piece, next_tet(THIS_FRAME));
+bool tetris::next_piece()
+{
+  assert(tetris::this_side != tetris::side_t::none);
 
-  update_drop_row(THIS_FRAME.piece);
+  return tetris::next_piece(THIS_FRAME);
 }
 
 bool tetris::lock_delay(tetris::piece& piece)
@@ -342,11 +372,16 @@ bool tetris::lock_delay(tetris::piece& piece)
   }
 }
 
-bool tetris::move(tetris::coord offset, int rotation)
+bool tetris::fits(const tetris::field& field, const tetris::piece& piece)
 {
-  assert(tetris::this_side != tetris::side_t::none);
+  if (piece.tet >= tetris::tet::empty || piece.facing >= tetris::dir::last)
+    return false;
+  return !collision(field, piece);
+}
 
-  tetris::piece& piece = THIS_FRAME.piece;
+bool tetris::move(tetris::frame& frame, tetris::coord offset, int rotation)
+{
+  tetris::piece& piece = frame.piece;
   tetris::piece p = piece;
   p.facing = (tetris::dir)(((unsigned int)piece.facing + rotation) % (unsigned int)tetris::dir::last);
 
@@ -367,14 +402,14 @@ bool tetris::move(tetris::coord offset, int rotation)
       p.pos.v += kick_v;
     }
 
-    if (collision(p)) {
+    if (collision(frame.field, p)) {
       continue;
     } else {
       piece.pos.u = p.pos.u;
       piece.pos.v = p.pos.v;
       piece.facing = p.facing;
       if (offset.u || rotation)
-        update_drop_row(piece);
+        update_drop_row(frame.field, piece);
 
       if (piece.lock_delay.locking) {
         piece.lock_delay.moves += 1;
@@ -387,6 +422,13 @@ bool tetris::move(tetris::coord offset, int rotation)
   return false;
 }
 
+bool tetris::move(tetris::coord offset, int rotation)
+{
+  assert(tetris::this_side != tetris::side_t::none);
+
+  return tetris::move(THIS_FRAME, offset, rotation);
+}
+
 static inline float _gravity(int level)
 {
   return std::pow((0.8 - ((level - 1) * 0.007)), (level - 1));
@@ -411,7 +453,7 @@ void __garbage(tetris::field& field, tetris::attack_t& attack)
 {
   assert(attack.rows > 0);
 
-  std::cerr << "_garbage processing\n";
+  LOG(trace, engine, "_garbage processing");
 
   for (int row = tetris::rows - 1; row >= 0; row--) {
     for (int col = 0; col < tetris::columns; col++) {
@@ -438,18 +480,22 @@ void tetris::_garbage(tetris::field& field, tetris::garbage_t& garbage)
 
 void tetris::attack(tetris::frame& frame, tetris::attack_t& attack)
 {
-  std::cerr << "received attack " << (void*)&frame << ' ' << attack.rows << '\n';
+  LOG(debug, engine, "received attack " << (void*)&frame << ' ' << attack.rows);
   frame.garbage.total += attack.rows;
   frame.garbage.attacks.push_back(attack);
 }
 
+void tetris::init(tetris::frame& frame)
+{
+  frame.queue.clear();
+  frame.bag.clear();
+  frame.piece.tet = tetris::tet::empty;
+  frame.swap = tetris::tet::empty;
+  frame.point = tetris::clock::now();
+}
+
 void tetris::init()
 {
-  for (int i = 0; i < tetris::frame_count; i++) {
-    tetris::frames[i].queue.clear();
-    tetris::frames[i].bag.clear();
-    tetris::frames[i].piece.tet = tetris::tet::empty;
-    tetris::frames[i].swap = tetris::tet::empty;
-    tetris::frames[i].point = tetris::clock::now();
-  }
+  for (int i = 0; i < tetris::frame_count; i++)
+    tetris::init(tetris::frames[i]);
 }
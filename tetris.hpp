@@ -42,7 +42,8 @@ namespace tetris {
     spin_cw,
     spin_ccw,
     spin_180,
-    swap
+    swap,
+    last
   };
 
   struct cell {
@@ -107,16 +108,26 @@ namespace tetris {
   extern std::array<frame, frame_count> frames;
   extern tetris::side_t this_side;
 
+  void reset_frame(tetris::frame& frame);
   void event_reset_frame(tetris::side_t side);
 
-  void swap();
+  // swap and next_piece are false if the new piece has no room to spawn,
+  // which ends the game; the frame needs a reset_frame() to go on
+  bool swap(tetris::frame& frame);
+  bool swap();
   int place(tetris::frame& frame);
+  int drop(tetris::frame& frame);
   void drop();
-  void next_piece();
+  bool next_piece(tetris::frame& frame);
+  bool next_piece();
   bool lock_delay(tetris::piece& piece);
+  // piece is a real piece, inside the field and clear of its cells
+  bool fits(const tetris::field& field, const tetris::piece& piece);
+  bool move(tetris::frame& frame, tetris::coord offset, int rotation);
   bool move(tetris::coord offset, int rotation);
   bool gravity(tetris::frame& frame);
   void _garbage(tetris::field& field, tetris::garbage_t& garbage);
   void attack(tetris::frame& frame, tetris::attack_t& attack);
+  void init(tetris::frame& frame);
   void init();
 }
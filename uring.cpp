@@ -0,0 +1,179 @@
+#include <cerrno>
+#include <cstring>
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "log.hpp"
+#include "uring.hpp"
+
+static void uassert(long ret, const char* s)
+{
+  if (ret < 0) {
+    LOG(error, net, s << ": " << std::strerror(errno));
+    throw s;
+  }
+}
+
+static int io_uring_setup(unsigned entries, struct io_uring_params * p)
+{
+  return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+  return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void * arg, unsigned nr_args)
+{
+  return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static inline unsigned load_acquire(const unsigned * p)
+{
+  return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static inline void store_release(unsigned * p, unsigned v)
+{
+  __atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+uring::uring(unsigned entries)
+{
+  struct io_uring_params p;
+  std::memset(&p, 0, (sizeof (p)));
+  // one thread owns the ring; completions run when it enters the kernel
+  p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+  p.cq_entries = entries * 4;
+
+  fd = io_uring_setup(entries, &p);
+  uassert(fd, "io_uring_setup");
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP))
+    throw "io_uring: IORING_FEAT_SINGLE_MMAP";
+
+  sq_len = p.sq_off.array + p.sq_entries * (sizeof (unsigned));
+  cq_len = p.cq_off.cqes + p.cq_entries * (sizeof (struct io_uring_cqe));
+  if (cq_len > sq_len)
+    sq_len = cq_len;
+  cq_len = sq_len;
+
+  sq_ptr = mmap(NULL, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (sq_ptr == MAP_FAILED)
+    uassert(-1, "mmap: IORING_OFF_SQ_RING");
+  cq_ptr = sq_ptr;
+
+  sqes_len = p.sq_entries * (sizeof (struct io_uring_sqe));
+  void * sqes_ptr = mmap(NULL, sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (sqes_ptr == MAP_FAILED)
+    uassert(-1, "mmap: IORING_OFF_SQES");
+  sqes = (struct io_uring_sqe *)sqes_ptr;
+
+  uint8_t * sq = (uint8_t *)sq_ptr;
+  sq_head = (unsigned *)(sq + p.sq_off.head);
+  sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+  sq_array = (unsigned *)(sq + p.sq_off.array);
+  sq_local_tail = *sq_tail;
+
+  // the sq array is an identity map; sqe i is always slot i
+  for (unsigned i = 0; i < p.sq_entries; i++)
+    sq_array[i] = i;
+
+  uint8_t * cq = (uint8_t *)cq_ptr;
+  cq_head = (unsigned *)(cq + p.cq_off.head);
+  cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+  cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+}
+
+uring::~uring()
+{
+  munmap(sqes, sqes_len);
+  munmap(sq_ptr, sq_len);
+  close(fd);
+}
+
+struct io_uring_sqe * uring::get_sqe()
+{
+  if (sq_local_tail - load_acquire(sq_head) > sq_mask)
+    submit(0);
+
+  struct io_uring_sqe * sqe = &sqes[sq_local_tail & sq_mask];
+  std::memset(sqe, 0, (sizeof (*sqe)));
+  sq_local_tail++;
+  return sqe;
+}
+
+int uring::submit(unsigned wait_nr)
+{
+  unsigned to_submit = sq_local_tail - *sq_tail;
+  store_release(sq_tail, sq_local_tail);
+
+  if (to_submit == 0 && wait_nr == 0)
+    return 0;
+
+  unsigned flags = IORING_ENTER_GETEVENTS; // also runs deferred completions
+  int ret;
+  do {
+    ret = io_uring_enter(fd, to_submit, wait_nr, flags);
+  } while (ret < 0 && errno == EINTR);
+  uassert(ret, "io_uring_enter");
+  return ret;
+}
+
+unsigned uring::cq_ready() const
+{
+  return load_acquire(cq_tail) - *cq_head;
+}
+
+void uring::cq_advance(unsigned n)
+{
+  store_release(cq_head, *cq_head + n);
+}
+
+uring_buffers::uring_buffers(uring& uring, uint16_t group, unsigned entries, unsigned buf_len)
+  : entries (entries)
+  , buf_len (buf_len)
+  , group (group)
+  , tail (0)
+{
+  std::size_t ring_len = entries * (sizeof (struct io_uring_buf));
+  void * ptr = mmap(NULL, ring_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ptr == MAP_FAILED)
+    uassert(-1, "mmap: buf_ring");
+  ring = (struct io_uring_buf_ring *)ptr;
+
+  bufs = new uint8_t[(std::size_t)entries * buf_len];
+
+  struct io_uring_buf_reg reg;
+  std::memset(&reg, 0, (sizeof (reg)));
+  reg.ring_addr = (uint64_t)ring;
+  reg.ring_entries = entries;
+  reg.bgid = group;
+  int ret = io_uring_register(uring.fd, IORING_REGISTER_PBUF_RING, &reg, 1);
+  uassert(ret, "io_uring_register: IORING_REGISTER_PBUF_RING");
+
+  for (unsigned i = 0; i < entries; i++)
+    recycle(i);
+}
+
+uring_buffers::~uring_buffers()
+{
+  munmap(ring, entries * (sizeof (struct io_uring_buf)));
+  delete[] bufs;
+}
+
+void uring_buffers::recycle(uint16_t id)
+{
+  // index the entries by hand: in C++ the header's flexible array member
+  // sits behind an empty struct of size 1, one slot off from the kernel's
+  struct io_uring_buf * b = reinterpret_cast<struct io_uring_buf *>(ring) + (tail & (entries - 1));
+  b->addr = (uint64_t)buf(id);
+  b->len = buf_len;
+  b->bid = id;
+  tail++;
+  __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include <linux/io_uring.h>
+
+// a minimal io_uring: submission and completion rings over the raw
+// syscalls, and one provided buffer ring for buffer-select receives
+
+struct uring
+{
+  int fd;
+
+  unsigned * sq_head;
+  unsigned * sq_tail;
+  unsigned sq_mask;
+  unsigned * sq_array;
+  struct io_uring_sqe * sqes;
+  unsigned sq_local_tail; // sqes prepared but not yet published
+
+  unsigned * cq_head;
+  unsigned * cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe * cqes;
+
+  void * sq_ptr;
+  std::size_t sq_len;
+  void * cq_ptr;
+  std::size_t cq_len;
+  std::size_t sqes_len;
+
+  uring(unsigned entries);
+  ~uring();
+
+  // a zeroed sqe; submits the pending ones first if the ring is full
+  struct io_uring_sqe * get_sqe();
+
+  // submit every prepared sqe and wait until at least wait_nr cqes are ready
+  int submit(unsigned wait_nr);
+
+  // call f(cqe) for every ready cqe, then release them to the kernel
+  template <typename F>
+  unsigned for_each_cqe(F&& f);
+
+  unsigned cq_ready() const;
+  void cq_advance(unsigned n);
+};
+
+struct uring_buffers
+{
+  struct io_uring_buf_ring * ring;
+  uint8_t * bufs;
+  unsigned entries; // power of two
+  unsigned buf_len;
+  uint16_t group;
+  uint16_t tail;
+
+  uring_buffers(uring& ring, uint16_t group, unsigned entries, unsigned buf_len);
+  ~uring_buffers();
+
+  uint8_t * buf(uint16_t id) { return bufs + (std::size_t)id * buf_len; }
+
+  // hand buffer id back to the kernel
+  void recycle(uint16_t id);
+};
+
+template <typename F>
+unsigned uring::for_each_cqe(F&& f)
+{
+  unsigned n = cq_ready();
+  unsigned head = *cq_head;
+  for (unsigned i = 0; i < n; i++)
+    f(cqes[(head + i) & cq_mask]);
+  cq_advance(n);
+  return n;
+}
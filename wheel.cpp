@@ -0,0 +1,96 @@
+#include <algorithm>
+
+#include "wheel.hpp"
+
+static inline void unlink(timer& t)
+{
+  t.prev->next = t.next;
+  t.next->prev = t.prev;
+  t.next = nullptr;
+  t.prev = nullptr;
+}
+
+static inline void link(timer& head, timer& t)
+{
+  t.next = head.next;
+  t.prev = &head;
+  head.next->prev = &t;
+  head.next = &t;
+}
+
+static inline void init_head(timer& head)
+{
+  head.next = &head;
+  head.prev = &head;
+}
+
+timer::~timer()
+{
+  if (wheel != nullptr)
+    wheel->cancel(*this);
+}
+
+timing_wheel::timing_wheel(uint64_t now)
+  : now (now)
+  , count (0)
+{
+  for (timer& head : slots)
+    init_head(head);
+}
+
+void timing_wheel::schedule(timer& t, uint64_t ticks)
+{
+  if (t.wheel != nullptr)
+    cancel(t);
+  t.deadline = now + std::max<uint64_t>(ticks, 1);
+  t.wheel = this;
+  link(slots[t.deadline & (slot_count - 1)], t);
+  count++;
+}
+
+void timing_wheel::cancel(timer& t)
+{
+  if (t.wheel != this)
+    return;
+  unlink(t);
+  t.wheel = nullptr;
+  count--;
+}
+
+void timing_wheel::advance(uint64_t to)
+{
+  if (to <= now)
+    return;
+
+  const uint64_t from = now;
+  now = to; // timers scheduled by a fn count from the new time
+  // past one revolution every slot is visited once and anything due fires
+  const uint64_t steps = std::min<uint64_t>(to - from, slot_count);
+
+  for (uint64_t i = 1; i <= steps; i++) {
+    timer& head = slots[(from + i) & (slot_count - 1)];
+    if (head.next == &head)
+      continue;
+
+    // detach the slot so fns can schedule and cancel freely while it is walked
+    timer pending;
+    init_head(pending);
+    pending.next = head.next;
+    pending.prev = head.prev;
+    pending.next->prev = &pending;
+    pending.prev->next = &pending;
+    init_head(head);
+
+    while (pending.next != &pending) {
+      timer& t = *pending.next;
+      unlink(t);
+      if (t.deadline <= to) {
+        t.wheel = nullptr;
+        count--;
+        t.fn(t);
+      } else {
+        link(head, t); // a later revolution
+      }
+    }
+  }
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+// hashed timing wheel: schedule and cancel are O(1), and each tick only
+// walks the one slot it lands on. timers are intrusive, so scheduling
+// never allocates; a timer further out than one revolution waits in its
+// slot until its deadline comes around
+
+struct timing_wheel;
+
+struct timer
+{
+  timer * next;
+  timer * prev;
+  uint64_t deadline; // in ticks
+  timing_wheel * wheel; // while scheduled
+  void (*fn)(timer&);
+  void * data;
+
+  timer()
+    : next (nullptr)
+    , prev (nullptr)
+    , deadline (0)
+    , wheel (nullptr)
+    , fn (nullptr)
+    , data (nullptr)
+  {
+  }
+
+  timer(void (*fn)(timer&), void * data)
+    : timer()
+  {
+    this->fn = fn;
+    this->data = data;
+  }
+
+  timer(const timer&) = delete;
+  timer& operator=(const timer&) = delete;
+
+  ~timer();
+
+  bool scheduled() const { return wheel != nullptr; }
+};
+
+struct timing_wheel
+{
+  static constexpr std::size_t slot_count = 4096; // power of two
+
+  std::array<timer, slot_count> slots; // list heads
+  uint64_t now; // the last tick advanced to
+  std::size_t count; // scheduled timers
+
+  timing_wheel(uint64_t now);
+
+  // fire t once `ticks` ticks from now (at least one); reschedules t if it
+  // is already scheduled
+  void schedule(timer& t, uint64_t ticks);
+  void cancel(timer& t);
+
+  // advance to tick `to`, firing every timer due by then; a timer is
+  // unscheduled before its fn runs, so fn may schedule it again
+  void advance(uint64_t to);
+};